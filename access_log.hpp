@@ -0,0 +1,276 @@
+#ifndef _ACCESSLOGHEAD_
+#define _ACCESSLOGHEAD_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Numbers the paths that show up in the access log, so a record carries a small id instead of a string
+// Paths are registered when a file is loaded, not while a request is answered
+class Path_registry {
+    public:
+        static Path_registry& instance()
+        {
+            static Path_registry registry;
+            return registry;
+        }
+
+        std::uint32_t id_of(const std::string& path)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = ids.find(path);
+            if (it != ids.end())
+            {
+                return it->second;
+            }
+            paths.push_back(path);
+            std::uint32_t id = paths.size() - 1;
+            ids.emplace(path, id);
+            return id;
+        }
+
+        std::string path_of(std::uint32_t id)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return id < paths.size() ? paths[id] : std::string("-");
+        }
+
+    private:
+        // Id 0 stands for requests that were not answered with a file
+        Path_registry() : paths{ "-" } {}
+
+        std::mutex mtx;
+        std::vector<std::string> paths;
+        std::unordered_map<std::string, std::uint32_t> ids;
+};
+
+// One request in the access log, fixed size so it can be copied into a ring without allocating
+struct Access_record {
+    enum Method : std::uint8_t { other, get, post };
+
+    std::int64_t time_ns;
+    std::uint64_t bytes;
+    std::uint32_t peer_address;
+    std::uint32_t path_id;
+    std::uint32_t latency_us;
+    std::uint16_t peer_port;
+    std::uint16_t status;
+    Method method;
+};
+
+class Access_log {
+    // Access log kept apart from the spdlog event logs
+    // Each thread that answers requests writes records into its own single producer ring, a background
+    // thread drains the rings, formats the records and writes them to the file in batches
+    // When a ring is full the record is dropped and counted, or with block set the thread waits for room
+
+    public:
+        // Records each thread can hold before the writer catches up
+        static const std::size_t ring_capacity = 4096;
+
+        Access_log(const std::string& path, bool block) : block(block)
+        {
+            if (path.empty())
+            {
+                return;
+            }
+            file = std::fopen(path.c_str(), "a");
+            if (file != nullptr)
+            {
+                writer = std::thread([this]() { write_loop(); });
+            }
+        }
+
+        ~Access_log()
+        {
+            stop();
+        }
+
+        bool enabled() const { return file != nullptr; }
+
+        // Called on the thread that answered the request, never allocates once the thread has its ring
+        void record(const Access_record& r)
+        {
+            if (file == nullptr)
+            {
+                return;
+            }
+            Ring& ring = thread_ring();
+            while (!ring.push(r))
+            {
+                if (!block || stopping.load(std::memory_order_relaxed))
+                {
+                    ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    return;
+                }
+                std::this_thread::yield();
+            }
+        }
+
+        // Records dropped because a ring was full
+        std::uint64_t dropped() const
+        {
+            std::lock_guard<std::mutex> lock(rings_mtx);
+            std::uint64_t total = 0;
+            for (auto& ring : rings)
+            {
+                total += ring->dropped.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        // Writes out what is left and stops the writer thread
+        void stop()
+        {
+            if (writer.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(wake_mtx);
+                    stopping.store(true);
+                }
+                wake.notify_one();
+                writer.join();
+            }
+            if (file != nullptr)
+            {
+                std::fclose(file);
+                file = nullptr;
+            }
+        }
+
+    private:
+        struct Ring {
+            std::array<Access_record, ring_capacity> records;
+            // Written by the consumer and producer respectively, kept on separate cache lines
+            alignas(64) std::atomic<std::size_t> head { 0 };
+            alignas(64) std::atomic<std::size_t> tail { 0 };
+            std::atomic<std::uint64_t> dropped { 0 };
+            std::uint64_t dropped_reported = 0;
+
+            bool push(const Access_record& r)
+            {
+                std::size_t t = tail.load(std::memory_order_relaxed);
+                if (t - head.load(std::memory_order_acquire) == ring_capacity)
+                {
+                    return false;
+                }
+                records[t % ring_capacity] = r;
+                tail.store(t + 1, std::memory_order_release);
+                return true;
+            }
+        };
+
+        Ring& thread_ring()
+        {
+            thread_local Access_log* owner = nullptr;
+            thread_local Ring* ring = nullptr;
+            if (owner != this)
+            {
+                std::lock_guard<std::mutex> lock(rings_mtx);
+                rings.emplace_back(new Ring());
+                ring = rings.back().get();
+                owner = this;
+            }
+            return *ring;
+        }
+
+        void write_loop()
+        {
+            std::string batch;
+            bool last = false;
+            while (!last)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(wake_mtx);
+                    wake.wait_for(lock, flush_interval, [this]() { return stopping.load(); });
+                    last = stopping.load();
+                }
+
+                std::vector<Ring*> current;
+                {
+                    std::lock_guard<std::mutex> lock(rings_mtx);
+                    for (auto& ring : rings)
+                    {
+                        current.push_back(ring.get());
+                    }
+                }
+
+                for (Ring* ring : current)
+                {
+                    drain(*ring, batch);
+                }
+
+                if (!batch.empty())
+                {
+                    std::fwrite(batch.data(), 1, batch.size(), file);
+                    std::fflush(file);
+                    batch.clear();
+                }
+            }
+        }
+
+        void drain(Ring& ring, std::string& batch)
+        {
+            std::size_t h = ring.head.load(std::memory_order_relaxed);
+            std::size_t t = ring.tail.load(std::memory_order_acquire);
+            for (; h != t; h++)
+            {
+                format(ring.records[h % ring_capacity], batch);
+            }
+            ring.head.store(h, std::memory_order_release);
+
+            std::uint64_t dropped = ring.dropped.load(std::memory_order_relaxed);
+            if (dropped != ring.dropped_reported)
+            {
+                batch += "# access log full, dropped " + std::to_string(dropped - ring.dropped_reported) + " records\n";
+                ring.dropped_reported = dropped;
+            }
+        }
+
+        // time peer method path status bytes latency
+        static void format(const Access_record& r, std::string& out)
+        {
+            std::time_t seconds = r.time_ns / 1000000000;
+            std::tm utc;
+            gmtime_r(&seconds, &utc);
+
+            char line[96];
+            std::strftime(line, sizeof(line), "%Y-%m-%dT%H:%M:%S", &utc);
+            out += line;
+
+            static const char* methods[] = { "-", "GET", "POST" };
+            std::snprintf(line, sizeof(line), ".%03dZ %u.%u.%u.%u:%u %s ",
+                static_cast<int>(r.time_ns / 1000000 % 1000),
+                r.peer_address >> 24, (r.peer_address >> 16) & 0xff, (r.peer_address >> 8) & 0xff, r.peer_address & 0xff,
+                r.peer_port, methods[r.method]);
+            out += line;
+            out += Path_registry::instance().path_of(r.path_id);
+            std::snprintf(line, sizeof(line), " %u %llu %uus\n", r.status, static_cast<unsigned long long>(r.bytes), r.latency_us);
+            out += line;
+        }
+
+    private:
+        const std::chrono::milliseconds flush_interval = std::chrono::milliseconds(50);
+
+        bool block;
+        std::FILE* file = nullptr;
+        std::thread writer;
+        std::atomic<bool> stopping { false };
+        std::mutex wake_mtx;
+        std::condition_variable wake;
+
+        mutable std::mutex rings_mtx;
+        std::vector<std::unique_ptr<Ring>> rings;
+};
+
+#endif  // _ACCESSLOGHEAD_
@@ -0,0 +1,199 @@
+#ifndef _ADMISSIONHEAD_
+#define _ADMISSIONHEAD_
+
+#include <boost/asio/ip/address.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class Admission {
+    // Decides whether a freshly accepted connection may be served
+    // The server wide budget is one atomic counter, taken with a fetch_add and handed back on a miss,
+    // so admitting a connection takes no lock
+    // The per source limit counts connections by client address in a hash map split into shards, each
+    // with its own lock, so connections from different addresses seldom wait on each other
+    // A limit of 0 turns that check off
+
+    public:
+        enum Result { admitted, server_full, source_full };
+
+        // Held by an admitted connection and handed back to release() when it closes
+        struct Ticket {
+            bool counted = false;
+            bool per_source = false;
+            std::array<unsigned char, 16> source {};
+        };
+
+        Admission(std::size_t max_connections, std::size_t max_per_source) :
+            max_connections(max_connections), max_per_source(max_per_source)
+        {
+        }
+
+        bool limits_connections() const { return max_connections != 0; }
+        bool limits_sources() const { return max_per_source != 0; }
+
+        bool full() const
+        {
+            return max_connections != 0 && active.load() >= max_connections;
+        }
+
+        std::size_t connections() const { return active.load(std::memory_order_relaxed); }
+
+        // Takes a slot ahead of an accept, so the connection it brings in is sure to fit the budget
+        bool reserve()
+        {
+            // A miss hands its slot straight back without waking anyone, nobody waiting could use it
+            if (active.fetch_add(1) >= max_connections && max_connections != 0)
+            {
+                active.fetch_sub(1);
+                return false;
+            }
+            return true;
+        }
+
+        // Gives back a slot reserved for an accept that brought no connection in
+        void unreserve()
+        {
+            release_slot();
+        }
+
+        // reserved says the slot was taken by reserve() already
+        // source is only looked at when there is a per source limit
+        Result admit(const boost::asio::ip::address& source, Ticket& ticket, bool reserved)
+        {
+            if (!reserved && !reserve())
+            {
+                return server_full;
+            }
+
+            if (max_per_source != 0)
+            {
+                ticket.source = source.is_v4() ? boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, source.to_v4()).to_bytes()
+                    : source.to_v6().to_bytes();
+                if (!count_source(ticket.source))
+                {
+                    // The slot is free for real, an acceptor waiting for one can have it
+                    release_slot();
+                    return source_full;
+                }
+                ticket.per_source = true;
+            }
+            ticket.counted = true;
+            return admitted;
+        }
+
+        void release(Ticket& ticket)
+        {
+            if (!ticket.counted)
+            {
+                return;
+            }
+            if (ticket.per_source)
+            {
+                Shard& shard = shard_of(ticket.source);
+                std::lock_guard<std::mutex> lock(shard.mtx);
+                auto it = shard.counts.find(ticket.source);
+                if (it != shard.counts.end() && --it->second == 0)
+                {
+                    shard.counts.erase(it);
+                }
+            }
+            ticket = Ticket();
+            release_slot();
+        }
+
+        // Runs resume once the budget has room again, straight away if it already has
+        // resume runs on whichever thread frees the slot, with no lock held
+        void when_room(std::function<void()> resume)
+        {
+            {
+                std::lock_guard<std::mutex> lock(waiters_mtx);
+                waiters.push_back(std::move(resume));
+                waiting.store(true);
+            }
+            // A slot freed before waiting was set would have gone unnoticed
+            if (!full())
+            {
+                wake();
+            }
+        }
+
+    private:
+        static const std::size_t shard_count = 64;
+
+        struct Source_hash {
+            std::size_t operator()(const std::array<unsigned char, 16>& source) const
+            {
+                std::uint64_t hash = 14695981039346656037ull;
+                for (unsigned char byte : source)
+                {
+                    hash = (hash ^ byte) * 1099511628211ull;
+                }
+                return hash;
+            }
+        };
+
+        struct alignas(64) Shard {
+            std::mutex mtx;
+            std::unordered_map<std::array<unsigned char, 16>, std::size_t, Source_hash> counts;
+        };
+
+        Shard& shard_of(const std::array<unsigned char, 16>& source)
+        {
+            return shards[(Source_hash()(source) >> 7) % shard_count];
+        }
+
+        bool count_source(const std::array<unsigned char, 16>& source)
+        {
+            Shard& shard = shard_of(source);
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            std::size_t& count = shard.counts[source];
+            if (count >= max_per_source)
+            {
+                return false;
+            }
+            count++;
+            return true;
+        }
+
+        void release_slot()
+        {
+            active.fetch_sub(1);
+            if (waiting.load())
+            {
+                wake();
+            }
+        }
+
+        void wake()
+        {
+            std::vector<std::function<void()>> ready;
+            {
+                std::lock_guard<std::mutex> lock(waiters_mtx);
+                ready.swap(waiters);
+                waiting.store(false);
+            }
+            for (auto& resume : ready)
+            {
+                resume();
+            }
+        }
+
+        const std::size_t max_connections;
+        const std::size_t max_per_source;
+        std::atomic<std::size_t> active { 0 };
+        std::array<Shard, shard_count> shards;
+
+        // Acceptors that stopped accepting while the budget was used up
+        std::atomic<bool> waiting { false };
+        std::mutex waiters_mtx;
+        std::vector<std::function<void()>> waiters;
+};
+
+#endif  // _ADMISSIONHEAD_
@@ -0,0 +1,627 @@
+#ifndef _COROSERVICEHEAD_
+#define _COROSERVICEHEAD_
+
+#include "server7.hpp"
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <sys/sendfile.h>
+
+
+// What a connection served by Coro_service starts with, everything else it needs lives in its Coro_service
+struct Coro_connection {
+    asio::ip::tcp::socket socket;
+    Service_context* context;
+    Timing_wheel* wheel;
+    Admission::Ticket ticket;
+};
+
+class Coro_service {
+    // The request loop of a connection written as one coroutine instead of a chain of callbacks
+    // The state of the connection is one Coro_service owned by the coroutine, taken from a per-thread
+    // free list like Service, so the frame only holds the locals of serve()
+    // Only one operation is ever in flight, so the coroutine needs no strand
+    // Serves the same requests as Service, which it falls short of in four ways
+    // The frames of serve() and of co_spawn's entry point come from asio, which keeps one spare frame per
+    // thread and takes the others from the heap, asio 1.74 never asks the completion token's associated
+    // allocator for them, so a new connection per request costs about 11 allocations against 5 for Service
+    // Pipelined responses are written one at a time where Service gathers up to pipeline_depth of them into
+    // one write, 8 deep pipelines get about a quarter fewer requests through
+    // A request for several ranges gets the whole file with a 200 rather than a multipart/byteranges 206
+    // And it runs on epoll only
+
+    public:
+        ~Coro_service()
+        {
+            wheel.cancel(deadline);
+            close_file();
+            boost::system::error_code ignored;
+            socket.close(ignored);
+            context.metrics.connection_closed();
+            context.admission.release(ticket);
+            if (head_copy != nullptr)
+            {
+                Block_pool<Buffer_allocator<char>::block_size>::deallocate(head_copy);
+            }
+        }
+
+        // The state of a connection comes from a per-thread free list like Service, so connection churn
+        // keeps reusing the same memory
+        static void* operator new(std::size_t)
+        {
+            return Block_pool<sizeof(Coro_service)>::allocate();
+        }
+        static void operator delete(void* p)
+        {
+            Block_pool<sizeof(Coro_service)>::deallocate(p);
+        }
+
+        // Serves a connection that has been accepted and admitted until it closes
+        static void start(Coro_connection connection)
+        {
+            auto executor = connection.socket.get_executor();
+            asio::co_spawn(executor, serve(std::move(connection)), asio::detached);
+        }
+
+    private:
+        explicit Coro_service(Coro_connection& connection) :
+            socket(std::move(connection.socket)), context(*connection.context), options(context.options), wheel(*connection.wheel),
+            ticket(connection.ticket), request(4096)
+        {
+            deadline.owner = this;
+            deadline.expired = &Coro_service::deadline_expired;
+        }
+
+        static asio::awaitable<void> serve(Coro_connection connection);
+
+        // Runs work() on the worker pool and resumes the coroutine with its result
+        // work is taken by reference and must be a named local, g++ 12 can destroy a temporary in a
+        // co_await expression twice
+        template <typename Work>
+        auto on_worker(const Work& work, boost::system::error_code& ec)
+        {
+            typedef decltype(work()) Result;
+            Worker_pool& workers = context.workers;
+            auto token = asio::redirect_error(asio::use_awaitable, ec);
+            return asio::async_initiate<decltype(token), void(boost::system::error_code, Result)>(
+                [&workers, work](auto handler)
+                {
+                    workers.submit(work, std::move(handler));
+                },
+                token);
+        }
+
+        // Waits for the render in flight and resumes the coroutine with the response
+        auto rendered(const Response_cache::Pending& pending, boost::system::error_code& ec)
+        {
+            auto token = asio::redirect_error(asio::use_awaitable, ec);
+            return asio::async_initiate<decltype(token), void(boost::system::error_code, std::shared_ptr<const Cached_file>)>(
+                [&pending](auto handler)
+                {
+                    //the waiter has to be copyable, the handler is only moved
+                    auto waiting = std::make_shared<decltype(handler)>(std::move(handler));
+                    Response_cache::wait(pending, [waiting](std::shared_ptr<const Cached_file> response)
+                    {
+                        auto executor = asio::get_associated_executor(*waiting);
+                        asio::post(executor, [waiting, response]()
+                        {
+                            (*waiting)(boost::system::error_code(), response);
+                        });
+                    });
+                },
+                token);
+        }
+
+        // The timing wheel calls this with the wheel locked, the coroutine can not end until it returns
+        // A shutdown is safe from any thread and makes the pending operation complete at once
+        static void deadline_expired(void* owner, std::uint64_t generation)
+        {
+            Coro_service* service = static_cast<Coro_service*>(owner);
+            if (generation == service->deadline.generation)
+            {
+                ::shutdown(service->fd, SHUT_RDWR);
+            }
+        }
+
+        void arm_deadline(std::chrono::milliseconds timeout)
+        {
+            wheel.arm(deadline, timeout);
+        }
+
+        // Returns the status to answer with, 0 when the request has no body or it was set up to be read
+        unsigned int start_body()
+        {
+            Body_decoder::Framing framing = body.start(request_header, options.max_body_bytes);
+            if (framing == Body_decoder::no_body)
+            {
+                return 0;
+            }
+            if (framing != Body_decoder::framed)
+            {
+                return framing == Body_decoder::unsupported_coding ? 501 : framing == Body_decoder::framed_too_large ? 413 : 400;
+            }
+
+            //the head moves out of the receive buffer so the buffer can take the body
+            if (head_copy == nullptr)
+            {
+                head_copy = static_cast<char*>(Block_pool<Buffer_allocator<char>::block_size>::allocate());
+            }
+            std::size_t head_length = request_header.length;
+            std::memcpy(head_copy, request.data().data(), head_length);
+            parser.reset();
+            parser.parse(head_copy, head_length, request_header);
+            request.consume(head_length);
+            head_consumed = true;
+            return 0;
+        }
+
+        // Settles the status, the copy of the file to send and the bytes of it, and opens a streamed file
+        void prepare_response()
+        {
+            if (!file)
+            {
+                status_code = 500;
+                return;
+            }
+            if (status_code == 200)
+            {
+                file = negotiate_coding(request_header, file, options, context.files, context.workers);
+            }
+            if (status_code == 200 && request_header.method == "GET" && not_modified(request_header, *file))
+            {
+                status_code = 304;
+                return;
+            }
+
+            std::uint64_t first = 0;
+            std::uint64_t length = file->size;
+            std::string_view range = request_header.header("Range");
+            if (status_code == 200 && request_header.method == "GET" && !range.empty() && range_applies(request_header, *file))
+            {
+                Byte_ranges::Result ranges = r_ranges.parse(range, file->size);
+                if (ranges == Byte_ranges::unsatisfiable)
+                {
+                    status_code = 416;
+                    return;
+                }
+                if (ranges == Byte_ranges::satisfiable && r_ranges.count == 1)
+                {
+                    status_code = 206;
+                    first = r_ranges.ranges[0].first;
+                    length = r_ranges.ranges[0].last - first + 1;
+                }
+            }
+
+            if (file->streamed)
+            {
+                r_fd = ::open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (r_fd < 0)
+                {
+                    status_code = 500;
+                    file.reset();
+                    return;
+                }
+                r_offset = first;
+                r_remaining = length;
+            }
+            else
+            {
+                r_body = std::string_view(file->body).substr(first, length);
+            }
+        }
+
+        // The header of the response in the order it goes out, followed by the part of the body held in memory
+        std::array<asio::const_buffer, 5> response_buffers()
+        {
+            std::array<asio::const_buffer, 5> buffers;
+            buffers[0] = asio::buffer(http_status_line(status_code));
+            char range[64];
+            if (!file || status_code == 416)
+            {
+                if (file)
+                {
+                    int n = std::snprintf(range, sizeof(range), "bytes */%llu", static_cast<unsigned long long>(file->size));
+                    r_header.add("content-range", std::string_view(range, n));
+                }
+                r_header.add("content-length", 0);
+            }
+            else if (status_code == 304)
+            {
+                buffers[1] = asio::buffer(file->headers);
+            }
+            else if (status_code == 206)
+            {
+                const Byte_range& only = r_ranges.ranges[0];
+                int n = std::snprintf(range, sizeof(range), "bytes %llu-%llu/%llu", static_cast<unsigned long long>(only.first),
+                    static_cast<unsigned long long>(only.last), static_cast<unsigned long long>(file->size));
+                buffers[1] = asio::buffer(file->headers);
+                r_header.add("content-range", std::string_view(range, n));
+                r_header.add("content-length", only.last - only.first + 1);
+            }
+            else
+            {
+                buffers[1] = asio::buffer(file->headers);
+                buffers[2] = asio::buffer(file->length_header);
+            }
+            r_header.add("connection", keep_alive ? "keep-alive" : "close");
+            r_header.append("\r\n");
+            buffers[3] = asio::buffer(r_header.view());
+            buffers[4] = asio::buffer(r_body);
+
+            //header lines that did not fit are never sent cut short, the response becomes a bare 500 instead
+            if (r_header.overflowed())
+            {
+                server_log().error("Response headers did not fit, sending 500");
+                status_code = 500;
+                keep_alive = false;
+                r_remaining = 0;
+                buffers.fill(asio::const_buffer());
+                buffers[0] = asio::buffer(http_status_line(status_code));
+                buffers[3] = asio::buffer(overflow_headers_g);
+            }
+            return buffers;
+        }
+
+        // Counts the response in the metrics and hands a record of it to the access log
+        void record_response()
+        {
+            std::uint64_t latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - request_start).count();
+            context.metrics.responded(http_status_index(status_code), bytes_sent, latency_ns);
+            timing.mark(Request_timing::sent);
+            context.stages.record(timing, fd, status_code);
+            if (!context.access_log.enabled())
+            {
+                return;
+            }
+
+            if (peer_port == 0)
+            {
+                boost::system::error_code ignored;
+                asio::ip::tcp::endpoint peer = socket.remote_endpoint(ignored);
+                if (peer.address().is_v4())
+                {
+                    peer_address = peer.address().to_v4().to_uint();
+                }
+                peer_port = peer.port();
+            }
+
+            Access_record record;
+            record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            record.bytes = bytes_sent;
+            record.peer_address = peer_address;
+            record.path_id = file ? file->path_id : 0;
+            record.latency_us = latency_ns / 1000;
+            record.peer_port = peer_port;
+            record.status = status_code;
+            record.method = request_header.method == "GET" ? Access_record::get : request_header.method == "POST" ? Access_record::post : Access_record::other;
+            context.access_log.record(record);
+        }
+
+        void close_file()
+        {
+            if (r_fd >= 0)
+            {
+                ::close(r_fd);
+                r_fd = -1;
+            }
+        }
+
+        // Clears what the last request left behind, bytes already buffered for the next one are kept
+        void reset_request()
+        {
+            if (!head_consumed)
+            {
+                request.consume(request_header.length);
+            }
+            head_consumed = false;
+            request_header.clear();
+            parser.reset();
+            r_header.clear();
+            timing.clear();
+            file.reset();
+            r_body = std::string_view();
+            close_file();
+            r_remaining = 0;
+            bytes_sent = 0;
+            status_code = 200;
+        }
+
+        asio::ip::tcp::socket socket;
+        const int fd = socket.native_handle();
+        Service_context& context;
+        const Server_options& options;
+        Timing_wheel& wheel;
+        Timing_wheel::Timer deadline;
+        Admission::Ticket ticket;
+
+        boost::asio::basic_streambuf<Buffer_allocator<char>> request;
+        Http_parser parser;
+        Http_request request_header;
+        char* head_copy = nullptr;
+        bool head_consumed = false;
+        Body_decoder body;
+        std::string r_route;
+        std::string r_path;
+        std::string r_cache_key;
+
+        std::shared_ptr<const Cached_file> file;
+        unsigned int status_code = 200;
+        bool keep_alive = true;
+        unsigned int requests_served = 0;
+        std::chrono::steady_clock::time_point request_start;
+        Request_timing timing;
+        Header_builder<256> r_header;
+        Byte_ranges r_ranges;
+        std::string_view r_body;
+        int r_fd = -1;
+        off_t r_offset = 0;
+        std::uint64_t r_remaining = 0;
+        std::uint64_t bytes_sent = 0;
+        std::uint32_t peer_address = 0;
+        std::uint16_t peer_port = 0;
+};
+
+inline asio::awaitable<void> Coro_service::serve(Coro_connection connection)
+{
+    std::unique_ptr<Coro_service> owner(new Coro_service(connection));
+    Coro_service& self = *owner;
+    Service_context& context = self.context;
+    const Server_options& options = self.options;
+    boost::system::error_code ec;
+
+    for (;;)
+    {
+        //the head of the next request, a pipelined one may be buffered already
+        self.timing.mark(Request_timing::waiting);
+        self.arm_deadline(self.requests_served == 0 || self.request.size() > 0 ? options.header_timeout : options.keep_alive_timeout);
+        std::size_t head = co_await asio::async_read_until(self.socket, self.request, "\r\n\r\n", asio::redirect_error(asio::use_awaitable, ec));
+        self.wheel.cancel(self.deadline);
+        if (ec && ec != asio::error::not_found)
+        {
+            co_return;
+        }
+        self.request_start = std::chrono::steady_clock::now();
+        self.timing.mark(Request_timing::head);
+        context.metrics.received(head);
+
+        //anything wrong with the head is answered and the connection closed, the rest of it is still on the wire
+        unsigned int refused = 0;
+        if (ec)
+        {
+            refused = 413;
+        }
+        else
+        {
+            auto data = self.request.data();
+            Http_parser::Result result = self.parser.parse(static_cast<const char*>(data.data()), data.size(), self.request_header);
+            if (result != Http_parser::complete)
+            {
+                refused = result == Http_parser::too_many_headers ? 431 : 400;
+            }
+            else if (self.request_header.method != "GET" && self.request_header.method != "POST")
+            {
+                refused = 501;
+            }
+            else if (self.request_header.version != "HTTP/1.1")
+            {
+                refused = 505;
+            }
+            else
+            {
+                self.timing.mark(Request_timing::parsed);
+                refused = self.start_body();
+            }
+        }
+
+        //the body goes to the sink a piece at a time, nothing more is read until the sink is done with a piece
+        if (refused == 0 && self.head_consumed)
+        {
+            if (header_iequals(self.request_header.header("Expect"), "100-continue"))
+            {
+                static constexpr std::string_view continue_line = "HTTP/1.1 100 Continue\r\n\r\n";
+                self.arm_deadline(options.write_timeout);
+                co_await asio::async_write(self.socket, asio::buffer(continue_line), asio::redirect_error(asio::use_awaitable, ec));
+                self.wheel.cancel(self.deadline);
+                if (ec)
+                {
+                    co_return;
+                }
+            }
+
+            for (;;)
+            {
+                auto data = self.request.data();
+                std::size_t consumed = 0;
+                std::string_view piece;
+                Body_decoder::Result result = self.body.next(static_cast<const char*>(data.data()), data.size(), consumed, piece);
+                if (result == Body_decoder::bad_body || result == Body_decoder::too_large)
+                {
+                    refused = result == Body_decoder::too_large ? 413 : 400;
+                    break;
+                }
+                if (result == Body_decoder::need_more)
+                {
+                    self.request.consume(consumed);
+                    if (self.request.size() >= self.request.max_size())
+                    {
+                        refused = 400;
+                        break;
+                    }
+                    self.arm_deadline(options.body_timeout);
+                    std::size_t bytes = co_await self.socket.async_read_some(self.request.prepare(self.request.max_size() - self.request.size()),
+                        asio::redirect_error(asio::use_awaitable, ec));
+                    self.wheel.cancel(self.deadline);
+                    if (ec)
+                    {
+                        co_return;
+                    }
+                    self.request.commit(bytes);
+                    context.metrics.received(bytes);
+                    continue;
+                }
+
+                bool last = result == Body_decoder::done;
+                Body_sink& sink = context.body_sink;
+                std::string_view target = self.request_header.target;
+                auto consume = [&sink, target, piece, last]()
+                {
+                    sink.consume(target, piece.data(), piece.size(), last);
+                    return true;
+                };
+                self.arm_deadline(options.handler_timeout);
+                co_await self.on_worker(consume, ec);
+                self.wheel.cancel(self.deadline);
+                if (ec)
+                {
+                    refused = 503;
+                    break;
+                }
+                self.request.consume(consumed);
+                if (last)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (refused != 0)
+        {
+            self.status_code = refused;
+            self.keep_alive = false;
+        }
+        else
+        {
+            self.timing.mark(Request_timing::body);
+            ++self.requests_served;
+            self.keep_alive = self.requests_served < options.max_keep_alive_requests
+                && !header_iequals(self.request_header.header("Connection"), "close") && !context.draining;
+
+            //the route decides what answers, a file is looked up in the cache and read on a worker on a miss
+            if (!Router::normalize(self.request_header.target, self.r_route))
+            {
+                self.status_code = 400;
+            }
+            else
+            {
+                Router::Match match = context.router.match(self.r_route);
+                const std::string* path = &self.r_path;
+                self.r_path.clear();
+                if (match.route && match.route->kind == Router::Route::handler && match.route->cache.ttl.count() > 0
+                    && self.request_header.method == "GET")
+                {
+                    //a cached handler route renders on the worker pool, once for every request that misses meanwhile
+                    Response_cache::make_key(self.request_header, match.route->cache, self.r_cache_key);
+                    Response_cache::Pending pending;
+                    Response_cache::Outcome outcome = context.responses.lookup(self.r_cache_key, self.file, pending);
+                    if (outcome == Response_cache::miss || outcome == Response_cache::refresh)
+                    {
+                        render_into_cache(context.workers, context.responses, *match.route, self.request_header, pending, self.socket.get_executor());
+                    }
+                    if (outcome == Response_cache::miss || outcome == Response_cache::coalesced)
+                    {
+                        self.arm_deadline(options.handler_timeout);
+                        self.file = co_await self.rendered(pending, ec);
+                        self.wheel.cancel(self.deadline);
+                    }
+                }
+                else if (match.route && match.route->kind == Router::Route::handler)
+                {
+                    self.file = match.route->render(self.request_header);
+                }
+                else
+                {
+                    if (match.route && match.route->kind == Router::Route::file)
+                    {
+                        path = &match.route->path;
+                    }
+                    else if (match.route)
+                    {
+                        self.r_path.assign(match.route->path).append(match.rest);
+                    }
+                    if (!path->empty())
+                    {
+                        self.file = context.files.find(*path);
+                    }
+                    if (!self.file)
+                    {
+                        File_cache& cache = context.files;
+                        const Router& router = context.router;
+                        auto lookup = [&cache, &router, path = *path]()
+                        {
+                            std::shared_ptr<const Cached_file> file = path.empty() ? nullptr : cache.get(path);
+                            if (file)
+                            {
+                                return std::make_pair(file, 200u);
+                            }
+                            return std::make_pair(cache.get(router.not_found_page()), 404u);
+                        };
+                        self.arm_deadline(options.handler_timeout);
+                        std::pair<std::shared_ptr<const Cached_file>, unsigned int> found = co_await self.on_worker(lookup, ec);
+                        self.wheel.cancel(self.deadline);
+                        if (ec)
+                        {
+                            self.status_code = 503;
+                        }
+                        else
+                        {
+                            self.file = std::move(found.first);
+                            self.status_code = found.second;
+                        }
+                    }
+                }
+                self.timing.mark(Request_timing::resolved);
+                if (self.status_code != 503)
+                {
+                    self.prepare_response();
+                }
+            }
+        }
+
+        //the header and any body held in memory go out in one write, a streamed body follows with sendfile
+        self.timing.mark(Request_timing::writing);
+        self.arm_deadline(options.write_timeout);
+        self.bytes_sent = co_await asio::async_write(self.socket, self.response_buffers(), asio::redirect_error(asio::use_awaitable, ec));
+        if (!ec && self.r_remaining > 0)
+        {
+            self.socket.native_non_blocking(true);
+        }
+        while (!ec && self.r_remaining > 0)
+        {
+            ssize_t sent = ::sendfile(self.fd, self.r_fd, &self.r_offset, self.r_remaining);
+            if (sent > 0)
+            {
+                self.r_remaining -= sent;
+                self.bytes_sent += sent;
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                self.arm_deadline(options.write_timeout);
+                co_await self.socket.async_wait(asio::ip::tcp::socket::wait_write, asio::redirect_error(asio::use_awaitable, ec));
+                continue;
+            }
+            //the file shrank or the socket failed, the client can not get the length it was promised
+            ec = sent == 0 ? boost::system::error_code(asio::error::eof) : boost::system::error_code(errno, boost::system::system_category());
+        }
+        self.wheel.cancel(self.deadline);
+        self.record_response();
+
+        if (ec || !self.keep_alive)
+        {
+            boost::system::error_code ignored;
+            self.socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+            co_return;
+        }
+        self.reset_request();
+    }
+}
+
+#endif  // BOOST_ASIO_HAS_CO_AWAIT
+
+#endif  // _COROSERVICEHEAD_
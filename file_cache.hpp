@@ -0,0 +1,768 @@
+#ifndef _FILECACHEHEAD_
+#define _FILECACHEHEAD_
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#include <zlib.h>
+
+#include "access_log.hpp"
+#include "io_uring.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Content codings a file can also be sent in, in the order they are preferred
+enum Content_coding { coding_br, coding_zstd, coding_gzip, content_codings };
+
+constexpr const char* content_coding_names_g[content_codings] = { "br", "zstd", "gzip" };
+constexpr const char* content_coding_suffixes_g[content_codings] = { ".br", ".zst", ".gz" };
+
+// A file body read from disk once and shared by every response that sends it
+// Entries are never modified after they are built, a changed file gets a new entry
+// The one exception is a compressed copy added later by the background compressor
+struct Cached_file {
+    std::string path;
+    // Empty for streamed files, those are sent from the page cache with sendfile
+    std::string body;
+    bool streamed = false;
+    // Header lines that belong to the file, rendered once when it is loaded
+    // The length is kept apart since a partial response sends a length of its own
+    std::string headers;
+    std::string length_header;
+    off_t size = 0;
+    time_t mtime = 0;
+    // Strong validator made from the inode, size and nanosecond mtime, quotes included
+    std::string etag;
+    std::string last_modified;
+    // Text that is worth compressing, judged by the file's extension
+    bool compressible = false;
+    // Compressed copies of the body by Content_coding, each a complete file with headers of its own
+    // Sibling .br/.zst/.gz files are found when the file is loaded and a gzip copy may be built later,
+    // so these are only read and written with std::atomic_load and std::atomic_store
+    mutable std::array<std::shared_ptr<const Cached_file>, content_codings> variants;
+    // Set once the background compressor has been asked for a gzip copy
+    mutable std::atomic<bool> compress_requested { false };
+    // Id the access log records the file under
+    std::uint32_t path_id = 0;
+};
+
+class File_cache {
+    // Thread safe cache of static files keyed by their resolved path
+    // Holds at most byte_budget bytes of file bodies and evicts the least recently used ones
+    // Entries are dropped when inotify reports a change to the file, if inotify is not available
+    // an entry is checked against the file's mtime once every revalidate_interval instead
+    // Every entry is dropped when inotify reports it lost events, and a file that changed while it was read is not kept
+    // Files bigger than stream_threshold are never read, only their size and headers are kept
+
+    public:
+        File_cache(boost::asio::io_context& ioc, std::size_t byte_budget, std::size_t stream_threshold) :
+            byte_budget(byte_budget), stream_threshold(stream_threshold), used_bytes(0), watcher(ioc)
+        {
+            int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd >= 0)
+            {
+                watcher.assign(fd);
+                watch_events();
+            }
+        }
+
+        // Returns the file at path if it is cached, never touches the disk unless inotify is unavailable
+        std::shared_ptr<const Cached_file> find(const std::string& path);
+
+        // Returns the file at path, loading it on a miss, or nullptr if it is not a readable regular file
+        // Files bigger than a quarter of the budget are returned but not kept
+        // A miss reads the whole file, so call it from a worker thread rather than an io_context thread
+        std::shared_ptr<const Cached_file> get(const std::string& path);
+
+        // Compresses an in memory file with gzip, nullptr if that would not make it smaller
+        // CPU heavy, only call it from a worker thread
+        static std::shared_ptr<const Cached_file> gzip(const Cached_file& file);
+
+        // Attaches a compressed copy to file if file is still the cached version of its path
+        // The copy counts against the budget like a file does and least recently used files make room for it
+        void add_variant(const std::shared_ptr<const Cached_file>& file, Content_coding coding,
+                         std::shared_ptr<const Cached_file> variant);
+
+        // Cold files are opened, stat'ed and read through io_uring, set before the server starts
+        void use_io_uring(bool enabled)
+        {
+            io_uring = enabled;
+        }
+
+        // Paths of up to limit cached files, most recently used first
+        std::vector<std::string> cached_paths(std::size_t limit)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            std::vector<std::string> paths;
+            for (auto it = lru.begin(); it != lru.end() && paths.size() < limit; ++it)
+            {
+                paths.push_back(*it);
+            }
+            return paths;
+        }
+
+        // Drops every entry, used when the server is stopped
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            drop_all();
+        }
+
+    private:
+        struct Entry {
+            std::shared_ptr<const Cached_file> file;
+            // Body bytes of the file and its compressed copies, counted against the budget
+            std::size_t bytes;
+            std::list<std::string>::iterator lru_pos;
+            // Key of the entry in watched, empty if its directory is not watched
+            std::string watch_key;
+            std::chrono::steady_clock::time_point checked;
+        };
+
+        // What a file is described by, filled from either stat or statx
+        struct File_stat {
+            unsigned long long ino;
+            off_t size;
+            time_t mtime;
+            long mtime_nsec;
+        };
+
+        std::shared_ptr<const Cached_file> load(const std::string& path, int coding = -1) const;
+        std::shared_ptr<const Cached_file> load_batched(const std::string& path) const;
+        std::shared_ptr<Cached_file> describe(const std::string& path, const File_stat& st, int coding) const;
+        static std::string render_headers(const Cached_file& file, int coding);
+        static bool compressible(const std::string& path);
+        void insert(const std::string& path, std::shared_ptr<const Cached_file> file, const std::string& key);
+        void erase(std::unordered_map<std::string, Entry>::iterator it);
+        int watch_directory(const std::string& path);
+        static std::string watch_key(int wd, std::string_view name);
+        void watch_events();
+        void on_events(std::size_t bytes);
+        void drop_watch(int wd);
+        void drop_all();
+
+        const std::chrono::seconds revalidate_interval = std::chrono::seconds(1);
+
+        std::mutex mtx;
+        std::size_t byte_budget;
+        std::size_t stream_threshold;
+        bool io_uring = false;
+        std::size_t used_bytes;
+        std::unordered_map<std::string, Entry> entries;
+        // Most recently used path at the front
+        std::list<std::string> lru;
+        // Cached paths by the watch descriptor of their directory and their file name, which is what an
+        // inotify event names, so an event finds the entries it is about without going through them all
+        std::unordered_multimap<std::string, std::string> watched;
+        // Files get() is reading outside the lock by their watch key, with how many reads are running and
+        // whether inotify reported a change meanwhile, in which case what was read is not kept
+        struct Load {
+            unsigned readers;
+            bool stale;
+        };
+        std::unordered_map<std::string, Load> loading;
+
+        boost::asio::posix::stream_descriptor watcher;
+        alignas(inotify_event) char events[4096];
+};
+
+inline std::shared_ptr<const Cached_file> File_cache::find(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = entries.find(path);
+    if (it == entries.end())
+    {
+        return nullptr;
+    }
+
+    Entry& entry = it->second;
+
+    // Without inotify the file has to be checked every so often
+    if (!watcher.is_open() && std::chrono::steady_clock::now() - entry.checked > revalidate_interval)
+    {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0 || st.st_mtime != entry.file->mtime || st.st_size != entry.file->size)
+        {
+            erase(it);
+            return nullptr;
+        }
+        entry.checked = std::chrono::steady_clock::now();
+    }
+
+    lru.splice(lru.begin(), lru, entry.lru_pos);
+    return entry.file;
+}
+
+inline std::shared_ptr<const Cached_file> File_cache::get(const std::string& path)
+{
+    std::shared_ptr<const Cached_file> file = find(path);
+    if (file)
+    {
+        return file;
+    }
+
+    // The directory is watched before the file is read, so a change made while it is read is reported
+    std::string key;
+    int wd = watch_directory(path);
+    if (wd >= 0)
+    {
+        key = watch_key(wd, boost::filesystem::path(path).filename().string());
+        std::lock_guard<std::mutex> lock(mtx);
+        loading[key].readers++;
+    }
+
+    // Read outside the lock so a slow disk does not stall hits on other files
+    file = io_uring ? load_batched(path) : load(path);
+    insert(path, file, key);
+    return file;
+}
+
+// Reads the file at path, coding is set when the file is a compressed copy of another
+inline std::shared_ptr<const Cached_file> File_cache::load(const std::string& path, int coding) const
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        ::close(fd);
+        return nullptr;
+    }
+
+    std::shared_ptr<Cached_file> file = describe(path, File_stat{ st.st_ino, st.st_size, st.st_mtime, st.st_mtim.tv_nsec }, coding);
+
+    // Precompressed siblings are only used while they are at least as new as the file
+    if (coding < 0)
+    {
+        for (int c = 0; c < content_codings; c++)
+        {
+            std::shared_ptr<const Cached_file> sibling = load(path + content_coding_suffixes_g[c], c);
+            if (sibling && sibling->mtime >= file->mtime)
+            {
+                file->variants[c] = sibling;
+            }
+        }
+    }
+
+    file->headers = render_headers(*file, coding);
+
+    if (file->streamed)
+    {
+        ::close(fd);
+        return file;
+    }
+
+    file->body.resize(st.st_size);
+
+    std::size_t done = 0;
+    while (done < file->body.size())
+    {
+        ssize_t n = ::read(fd, &file->body[done], file->body.size() - done);
+        if (n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    ::close(fd);
+
+    // The file shrank while it was read, send what is there
+    if (done != file->body.size())
+    {
+        file->body.resize(done);
+        file->size = done;
+        file->length_header = std::string("content-length: ") + std::to_string(done) + "\r\n";
+    }
+    return file;
+}
+
+// Loads the file and its precompressed siblings with two io_uring submissions instead of a system call
+// for every open, stat, read and close
+// The first opens and stats all of them at once, a sibling that does not exist just fails its two
+// operations, the second reads every body that is kept and closes every descriptor
+inline std::shared_ptr<const Cached_file> File_cache::load_batched(const std::string& path) const
+{
+    const int count = 1 + content_codings;
+    thread_local Io_ring ring(4 * count);
+    if (!ring.is_open())
+    {
+        return load(path);
+    }
+
+    std::string paths[count];
+    struct statx stats[count];
+    int fds[count];
+    int stat_results[count];
+    paths[0] = path;
+    for (int c = 0; c < content_codings; c++)
+    {
+        paths[1 + c] = path + content_coding_suffixes_g[c];
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        io_uring_sqe* open = ring.get_sqe();
+        open->opcode = IORING_OP_OPENAT;
+        open->fd = AT_FDCWD;
+        open->addr = reinterpret_cast<std::uint64_t>(paths[i].c_str());
+        open->open_flags = O_RDONLY | O_CLOEXEC;
+        open->user_data = 2 * i;
+
+        io_uring_sqe* stat = ring.get_sqe();
+        stat->opcode = IORING_OP_STATX;
+        stat->fd = AT_FDCWD;
+        stat->addr = reinterpret_cast<std::uint64_t>(paths[i].c_str());
+        stat->len = STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME;
+        stat->off = reinterpret_cast<std::uint64_t>(&stats[i]);
+        stat->user_data = 2 * i + 1;
+    }
+
+    io_uring_cqe cqe;
+    int waiting = 2 * count;
+    while (waiting > 0 && ring.submit(waiting) >= 0)
+    {
+        while (ring.peek(cqe))
+        {
+            int i = static_cast<int>(cqe.user_data / 2);
+            (cqe.user_data % 2 == 0 ? fds[i] : stat_results[i]) = cqe.res;
+            waiting--;
+        }
+    }
+    if (waiting > 0)
+    {
+        // The ring failed, the descriptors it may have opened are unknown so leave it to the plain path
+        return load(path);
+    }
+
+    std::shared_ptr<Cached_file> files[count];
+    for (int i = 0; i < count; i++)
+    {
+        if (fds[i] >= 0 && stat_results[i] == 0 && S_ISREG(stats[i].stx_mode))
+        {
+            const struct statx& st = stats[i];
+            files[i] = describe(paths[i], File_stat{ st.stx_ino, static_cast<off_t>(st.stx_size), st.stx_mtime.tv_sec, st.stx_mtime.tv_nsec }, i - 1);
+        }
+    }
+
+    // Precompressed siblings are only used while they are at least as new as the file
+    if (files[0])
+    {
+        for (int c = 0; c < content_codings; c++)
+        {
+            if (files[1 + c] && files[1 + c]->mtime < files[0]->mtime)
+            {
+                files[1 + c].reset();
+            }
+        }
+    }
+    else
+    {
+        for (auto& file : files)
+        {
+            file.reset();
+        }
+    }
+
+    // Each read is hard linked to the close of its descriptor, so the close waits for it even if the read fails
+    waiting = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (fds[i] < 0)
+        {
+            continue;
+        }
+        if (files[i] && !files[i]->streamed && files[i]->size > 0)
+        {
+            files[i]->body.resize(files[i]->size);
+            io_uring_sqe* read = ring.get_sqe();
+            read->opcode = IORING_OP_READ;
+            read->fd = fds[i];
+            read->addr = reinterpret_cast<std::uint64_t>(&files[i]->body[0]);
+            read->len = static_cast<std::uint32_t>(files[i]->body.size());
+            read->flags = IOSQE_IO_HARDLINK;
+            read->user_data = 2 * i;
+            waiting++;
+        }
+        io_uring_sqe* close = ring.get_sqe();
+        close->opcode = IORING_OP_CLOSE;
+        close->fd = fds[i];
+        close->user_data = 2 * i + 1;
+        waiting++;
+    }
+
+    while (waiting > 0 && ring.submit(waiting) >= 0)
+    {
+        while (ring.peek(cqe))
+        {
+            waiting--;
+            int i = static_cast<int>(cqe.user_data / 2);
+            if (cqe.user_data % 2 == 1 || !files[i])
+            {
+                continue;
+            }
+            // The file shrank while it was read, send what is there
+            std::size_t done = cqe.res > 0 ? cqe.res : 0;
+            if (done != files[i]->body.size())
+            {
+                files[i]->body.resize(done);
+                files[i]->size = done;
+                files[i]->length_header = std::string("content-length: ") + std::to_string(done) + "\r\n";
+            }
+        }
+    }
+
+    if (!files[0])
+    {
+        return nullptr;
+    }
+    for (int c = 0; c < content_codings; c++)
+    {
+        files[0]->variants[c] = files[1 + c];
+    }
+    files[0]->headers = render_headers(*files[0], -1);
+    return files[0];
+}
+
+// Builds the entry for a file from its stat, everything but the body and the headers that depend on its variants
+inline std::shared_ptr<Cached_file> File_cache::describe(const std::string& path, const File_stat& st, int coding) const
+{
+    auto file = std::make_shared<Cached_file>();
+    file->path = path;
+    file->path_id = Path_registry::instance().id_of(path);
+    file->size = st.size;
+    file->mtime = st.mtime;
+
+    char etag[64];
+    std::snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"", st.ino,
+        static_cast<unsigned long long>(st.size), static_cast<unsigned long long>(st.mtime * 1000000000ull + st.mtime_nsec));
+    file->etag = etag;
+
+    char modified[64];
+    std::tm utc;
+    gmtime_r(&st.mtime, &utc);
+    std::strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &utc);
+    file->last_modified = modified;
+
+    if (coding < 0)
+    {
+        file->compressible = compressible(path);
+    }
+    file->length_header = std::string("content-length: ") + std::to_string(st.size) + "\r\n";
+    file->streamed = static_cast<std::size_t>(st.size) > stream_threshold;
+    return file;
+}
+
+// Header lines sent with every response for the file, responses that can differ by Accept-Encoding say so with Vary
+inline std::string File_cache::render_headers(const Cached_file& file, int coding)
+{
+    std::string headers = "accept-ranges: bytes\r\netag: " + file.etag + "\r\nlast-modified: " + file.last_modified + "\r\n";
+
+    bool varies = coding >= 0 || file.compressible;
+    for (auto& variant : file.variants)
+    {
+        varies = varies || variant;
+    }
+    if (coding >= 0)
+    {
+        headers.append("content-encoding: ").append(content_coding_names_g[coding]).append("\r\n");
+    }
+    if (varies)
+    {
+        headers.append("vary: accept-encoding\r\n");
+    }
+    return headers;
+}
+
+inline bool File_cache::compressible(const std::string& path)
+{
+    static const char* types[] = { ".html", ".htm", ".css", ".js", ".mjs", ".json", ".svg", ".txt", ".xml", ".csv", ".md" };
+    std::string ext = boost::filesystem::path(path).extension().string();
+    for (const char* type : types)
+    {
+        if (ext == type)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline std::shared_ptr<const Cached_file> File_cache::gzip(const Cached_file& file)
+{
+    z_stream zs {};
+    // 15 window bits plus 16 asks zlib for a gzip wrapper instead of a zlib one
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return nullptr;
+    }
+
+    auto variant = std::make_shared<Cached_file>();
+    variant->body.resize(deflateBound(&zs, file.body.size()));
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(file.body.data()));
+    zs.avail_in = file.body.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&variant->body[0]);
+    zs.avail_out = variant->body.size();
+    int result = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+
+    if (result != Z_STREAM_END || zs.total_out >= file.body.size())
+    {
+        return nullptr;
+    }
+
+    variant->body.resize(zs.total_out);
+    variant->path = file.path;
+    variant->path_id = file.path_id;
+    variant->size = variant->body.size();
+    variant->mtime = file.mtime;
+    variant->etag = file.etag.substr(0, file.etag.size() - 1) + "-gzip\"";
+    variant->last_modified = file.last_modified;
+    variant->headers = render_headers(*variant, coding_gzip);
+    variant->length_header = std::string("content-length: ") + std::to_string(variant->size) + "\r\n";
+    return variant;
+}
+
+inline void File_cache::add_variant(const std::shared_ptr<const Cached_file>& file, Content_coding coding,
+                                    std::shared_ptr<const Cached_file> variant)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = entries.find(file->path);
+    std::size_t bytes = variant->body.size();
+    // a variant that could not fit even with every other file dropped is not kept
+    if (it == entries.end() || it->second.file != file || it->second.bytes + bytes > byte_budget)
+    {
+        return;
+    }
+
+    // Room is made from the least recently used end like insert() does, the file the variant belongs
+    // to was just asked for so it goes to the front first and is never the one dropped
+    lru.splice(lru.begin(), lru, it->second.lru_pos);
+    while (used_bytes + bytes > byte_budget && lru.back() != file->path)
+    {
+        erase(entries.find(lru.back()));
+    }
+    used_bytes += bytes;
+    it->second.bytes += bytes;
+    std::atomic_store(&file->variants[coding], std::move(variant));
+}
+
+// Keeps a file get() has read, key is its watch key or empty if its directory is not watched
+inline void File_cache::insert(const std::string& path, std::shared_ptr<const Cached_file> file, const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!key.empty())
+    {
+        auto l = loading.find(key);
+        bool stale = l->second.stale;
+        if (--l->second.readers == 0)
+        {
+            loading.erase(l);
+        }
+        if (stale)
+        {
+            return;
+        }
+    }
+    if (!file || file->body.size() > byte_budget / 4)
+    {
+        return;
+    }
+
+    // Another thread may have loaded the same file meanwhile
+    auto it = entries.find(path);
+    if (it != entries.end())
+    {
+        erase(it);
+    }
+
+    std::size_t bytes = file->body.size();
+    for (auto& variant : file->variants)
+    {
+        bytes += variant ? variant->body.size() : 0;
+    }
+
+    while (used_bytes + bytes > byte_budget && !lru.empty())
+    {
+        erase(entries.find(lru.back()));
+    }
+
+    lru.push_front(path);
+    Entry entry { file, bytes, lru.begin(), key, std::chrono::steady_clock::now() };
+    if (!key.empty())
+    {
+        watched.emplace(key, path);
+    }
+    entries.emplace(path, std::move(entry));
+    used_bytes += bytes;
+}
+
+inline void File_cache::erase(std::unordered_map<std::string, Entry>::iterator it)
+{
+    used_bytes -= it->second.bytes;
+    lru.erase(it->second.lru_pos);
+    if (!it->second.watch_key.empty())
+    {
+        auto range = watched.equal_range(it->second.watch_key);
+        for (auto w = range.first; w != range.second; ++w)
+        {
+            if (w->second == it->first)
+            {
+                watched.erase(w);
+                break;
+            }
+        }
+    }
+    entries.erase(it);
+}
+
+inline std::string File_cache::watch_key(int wd, std::string_view name)
+{
+    std::string key = std::to_string(wd);
+    key.push_back('/');
+    key.append(name.data(), name.size());
+    return key;
+}
+
+// Adds an inotify watch on the directory holding path, returns the watch descriptor or -1
+inline int File_cache::watch_directory(const std::string& path)
+{
+    if (!watcher.is_open())
+    {
+        return -1;
+    }
+
+    std::string dir = boost::filesystem::path(path).parent_path().string();
+    return inotify_add_watch(watcher.native_handle(), dir.c_str(),
+        IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE |
+        IN_DELETE_SELF | IN_MOVE_SELF);
+}
+
+inline void File_cache::watch_events()
+{
+    watcher.async_read_some(boost::asio::buffer(events), [this](const boost::system::error_code& ec, std::size_t bytes)
+    {
+        if (ec)
+        {
+            return;
+        }
+        on_events(bytes);
+        watch_events();
+    });
+}
+
+// Drops the entries of every file inotify reported a change for
+inline void File_cache::on_events(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    for (std::size_t pos = 0; pos < bytes; )
+    {
+        auto* event = reinterpret_cast<const inotify_event*>(events + pos);
+        pos += sizeof(inotify_event) + event->len;
+
+        // Events were lost, so nothing cached can be trusted any more
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+            drop_all();
+            continue;
+        }
+        // The directory itself went away or moved, or its watch was removed, so its files are no longer watched
+        if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT))
+        {
+            drop_watch(event->wd);
+            continue;
+        }
+        if (event->len == 0)
+        {
+            continue;
+        }
+
+        // A change to a compressed sibling also drops the file it belongs to
+        std::string_view name(event->name);
+        std::string_view base = name;
+        for (const char* suffix : content_coding_suffixes_g)
+        {
+            std::size_t n = std::strlen(suffix);
+            if (base.size() > n && base.compare(base.size() - n, n, suffix) == 0)
+            {
+                base.remove_suffix(n);
+                break;
+            }
+        }
+
+        for (std::string_view changed : { name, base })
+        {
+            std::string key = watch_key(event->wd, changed);
+            for (auto w = watched.find(key); w != watched.end(); w = watched.find(key))
+            {
+                erase(entries.find(w->second));
+            }
+            auto l = loading.find(key);
+            if (l != loading.end())
+            {
+                l->second.stale = true;
+            }
+        }
+    }
+}
+
+// Drops the entries and marks stale the reads of every file in the directory watched by wd, called with mtx held
+inline void File_cache::drop_watch(int wd)
+{
+    std::string prefix = watch_key(wd, std::string_view());
+    std::vector<std::string> paths;
+    for (const auto& w : watched)
+    {
+        if (w.first.compare(0, prefix.size(), prefix) == 0)
+        {
+            paths.push_back(w.second);
+        }
+    }
+    for (const std::string& path : paths)
+    {
+        erase(entries.find(path));
+    }
+    for (auto& l : loading)
+    {
+        if (l.first.compare(0, prefix.size(), prefix) == 0)
+        {
+            l.second.stale = true;
+        }
+    }
+}
+
+// Drops every entry and marks every read in progress stale, called with mtx held
+inline void File_cache::drop_all()
+{
+    entries.clear();
+    watched.clear();
+    lru.clear();
+    used_bytes = 0;
+    for (auto& l : loading)
+    {
+        l.second.stale = true;
+    }
+}
+
+#endif  // _FILECACHEHEAD_
@@ -0,0 +1,57 @@
+// Checks how Body_decoder::start reads the framing headers of a request, in particular that a
+// request whose body could be read two ways is refused
+// Build: g++ -std=c++17 -O2 framing_test.cpp -o framing_test
+// Run:   ./framing_test, it prints every case that fails and exits with 1 if any did
+
+#include "http_parser.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+static int failures = 0;
+
+static void expect(const char* head, Body_decoder::Framing expected)
+{
+    Http_parser parser;
+    Http_request request;
+    if (parser.parse(head, std::strlen(head), request) != Http_parser::complete)
+    {
+        std::printf("FAIL could not parse: %s\n", head);
+        failures++;
+        return;
+    }
+
+    Body_decoder body;
+    Body_decoder::Framing framing = body.start(request, 1024);
+    if (framing != expected)
+    {
+        std::printf("FAIL got %d, expected %d: %s\n", framing, expected, head);
+        failures++;
+    }
+}
+
+int main()
+{
+    expect("GET / HTTP/1.1\r\nHost: a\r\n\r\n", Body_decoder::no_body);
+    expect("POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\n", Body_decoder::framed);
+    expect("POST / HTTP/1.1\r\nContent-Length: 0\r\n\r\n", Body_decoder::no_body);
+    expect("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", Body_decoder::framed);
+    expect("POST / HTTP/1.1\r\nContent-Length: 5000\r\n\r\n", Body_decoder::framed_too_large);
+    expect("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", Body_decoder::unsupported_coding);
+    expect("POST / HTTP/1.1\r\nContent-Length: 5x\r\n\r\n", Body_decoder::bad_framing);
+
+    // Conflicting lengths, a repeated length and the two framings together could each be read two ways
+    expect("POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 5\r\n\r\n", Body_decoder::bad_framing);
+    expect("POST / HTTP/1.1\r\nContent-Length: 5\r\ncontent-length: 5\r\n\r\n", Body_decoder::bad_framing);
+    expect("POST / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n", Body_decoder::bad_framing);
+    expect("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n", Body_decoder::bad_framing);
+    expect("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n", Body_decoder::bad_framing);
+    // An empty length is still a length, it must not let the transfer coding through
+    expect("POST / HTTP/1.1\r\nContent-Length:\r\nTransfer-Encoding: chunked\r\n\r\n", Body_decoder::bad_framing);
+
+    if (failures == 0)
+    {
+        std::printf("all framing cases passed\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,163 @@
+#ifndef _HANDOFFHEAD_
+#define _HANDOFFHEAD_
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// What a running server hands to the binary that replaces it, over a Unix socket
+// The listening sockets travel as SCM_RIGHTS ancillary data on a "listeners <n>" line, the paths of the
+// files it has cached follow one per line, most recently used first, and the old server closes the
+// connection once everything is sent
+struct Handoff {
+    std::vector<int> fds;
+    std::vector<std::string> paths;
+
+    // Most listening sockets one handoff carries
+    static const std::size_t max_fds = 64;
+
+    // Connects to the handoff socket at path and takes over whatever the server listening there sends,
+    // returns an empty handoff if no server is listening
+    static Handoff receive(const std::string& path)
+    {
+        Handoff handoff;
+        sockaddr_un address;
+        if (!make_address(path, address))
+        {
+            return handoff;
+        }
+
+        int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+        {
+            return handoff;
+        }
+        // A server that accepts but never answers must not hold the new one up for good
+        timeval timeout { 5, 0 };
+        ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (::connect(sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+        {
+            ::close(sock);
+            return handoff;
+        }
+
+        std::string text;
+        char data[4096];
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_fds)];
+        for (;;)
+        {
+            iovec iov { data, sizeof(data) };
+            msghdr msg {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            if (n <= 0)
+            {
+                break;
+            }
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                {
+                    std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+                    handoff.fds.insert(handoff.fds.end(), fds, fds + count);
+                }
+            }
+            text.append(data, n);
+        }
+        ::close(sock);
+
+        // Without the header line the sockets can not be trusted to be the whole set
+        unsigned long expected = 0;
+        std::size_t line_end = text.find('\n');
+        if (line_end == std::string::npos || std::sscanf(text.c_str(), "listeners %lu", &expected) != 1 || expected != handoff.fds.size())
+        {
+            for (int fd : handoff.fds)
+            {
+                ::close(fd);
+            }
+            handoff.fds.clear();
+            return handoff;
+        }
+
+        for (std::size_t pos = line_end + 1; pos < text.size(); )
+        {
+            std::size_t end = text.find('\n', pos);
+            if (end == std::string::npos)
+            {
+                break;
+            }
+            handoff.paths.emplace_back(text, pos, end - pos);
+            pos = end + 1;
+        }
+        return handoff;
+    }
+
+    // Sends the sockets and paths over sock, a connection accepted on the handoff socket
+    static bool send(int sock, const std::vector<int>& fds, const std::vector<std::string>& paths)
+    {
+        if (fds.empty() || fds.size() > max_fds)
+        {
+            return false;
+        }
+
+        char header[32];
+        int length = std::snprintf(header, sizeof(header), "listeners %zu\n", fds.size());
+        iovec iov { header, static_cast<std::size_t>(length) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_fds)];
+        msghdr msg {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+        if (::sendmsg(sock, &msg, MSG_NOSIGNAL) != length)
+        {
+            return false;
+        }
+
+        std::string text;
+        for (const std::string& path : paths)
+        {
+            text.append(path).append("\n");
+        }
+        for (std::size_t done = 0; done < text.size(); )
+        {
+            ssize_t n = ::send(sock, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                // The sockets are across already, only the cache warming is lost
+                break;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    static bool make_address(const std::string& path, sockaddr_un& address)
+    {
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path))
+        {
+            return false;
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+};
+
+#endif  // _HANDOFFHEAD_
@@ -0,0 +1,71 @@
+#ifndef _HEADERBUILDERHEAD_
+#define _HEADERBUILDERHEAD_
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// Renders response header lines into a fixed buffer, so building a response never allocates
+// Once a line does not fit nothing more is added and overflowed() reports it, the lines are then
+// incomplete and must not be sent
+template <std::size_t Capacity>
+class Header_builder {
+    public:
+        Header_builder& add(std::string_view name, std::string_view value)
+        {
+            if (overflow || length + name.size() + value.size() + 4 > Capacity)
+            {
+                overflow = true;
+                return *this;
+            }
+            put(name);
+            put(": ");
+            put(value);
+            put("\r\n");
+            return *this;
+        }
+
+        Header_builder& add(std::string_view name, std::uint64_t value)
+        {
+            char digits[20];
+            auto result = std::to_chars(digits, digits + sizeof(digits), value);
+            return add(name, std::string_view(digits, result.ptr - digits));
+        }
+
+        // Copies already formatted text, such as the blank line that ends the header block
+        Header_builder& append(std::string_view raw)
+        {
+            if (overflow || length + raw.size() > Capacity)
+            {
+                overflow = true;
+                return *this;
+            }
+            put(raw);
+            return *this;
+        }
+
+        void clear()
+        {
+            length = 0;
+            overflow = false;
+        }
+
+        std::string_view view() const { return std::string_view(data, length); }
+        std::size_t size() const { return length; }
+        bool overflowed() const { return overflow; }
+
+    private:
+        void put(std::string_view s)
+        {
+            std::memcpy(data + length, s.data(), s.size());
+            length += s.size();
+        }
+
+        char data[Capacity];
+        std::size_t length = 0;
+        bool overflow = false;
+};
+
+#endif  // _HEADERBUILDERHEAD_
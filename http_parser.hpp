@@ -0,0 +1,632 @@
+#ifndef _HTTPPARSERHEAD_
+#define _HTTPPARSERHEAD_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string_view>
+
+// Compares two header names ignoring ASCII case, header names are never locale dependent
+inline bool header_iequals(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    for (std::size_t i = 0; i < a.size(); i++)
+    {
+        char x = a[i], y = b[i];
+        if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+        if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+        if (x != y)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct Http_header {
+    std::string_view name;
+    std::string_view value;
+};
+
+// Request line and headers of one request
+// Every view points into the receive buffer the request was parsed from, so they are only
+// valid until those bytes are consumed
+struct Http_request {
+    static const std::size_t max_headers = 32;
+
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    std::array<Http_header, max_headers> headers;
+    std::size_t header_count = 0;
+    // Bytes taken by the request line, the headers and the blank line after them
+    std::size_t length = 0;
+
+    // Value of the first header called name, empty if there is none
+    std::string_view header(std::string_view name) const
+    {
+        for (std::size_t i = 0; i < header_count; i++)
+        {
+            if (header_iequals(headers[i].name, name))
+            {
+                return headers[i].value;
+            }
+        }
+        return std::string_view();
+    }
+
+    // How many headers are called name
+    std::size_t count(std::string_view name) const
+    {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < header_count; i++)
+        {
+            if (header_iequals(headers[i].name, name))
+            {
+                n++;
+            }
+        }
+        return n;
+    }
+
+    void clear()
+    {
+        method = target = version = std::string_view();
+        header_count = 0;
+        length = 0;
+    }
+};
+
+class Http_parser {
+    // Parses the head of a request in a single pass over the received bytes without copying or allocating
+    // Feed it everything received so far, it remembers how far it looked for the end of the head so
+    // calling it again after more bytes arrive does not scan the same bytes twice
+
+    public:
+        enum Result { complete, incomplete, bad_request, too_many_headers };
+
+        Result parse(const char* data, std::size_t size, Http_request& req)
+        {
+            // Find the blank line that ends the head before splitting it up
+            const char* end = find_head_end(data, size);
+            if (end == nullptr)
+            {
+                return incomplete;
+            }
+
+            req.clear();
+            scanned = 0;
+            const char* pos = data;
+
+            if (!token(pos, end, ' ', req.method) || !token(pos, end, ' ', req.target) || !line(pos, end, req.version))
+            {
+                return bad_request;
+            }
+
+            while (!(pos[0] == '\r' && pos[1] == '\n'))
+            {
+                if (req.header_count == Http_request::max_headers)
+                {
+                    return too_many_headers;
+                }
+
+                Http_header& h = req.headers[req.header_count];
+                std::string_view value;
+                if (!token(pos, end, ':', h.name) || !line(pos, end, value))
+                {
+                    return bad_request;
+                }
+                h.value = trim(value);
+                req.header_count++;
+            }
+
+            req.length = pos + 2 - data;
+            return complete;
+        }
+
+        // Forgets the progress of an incomplete head, used once those bytes have been dropped
+        void reset()
+        {
+            scanned = 0;
+        }
+
+    private:
+        // Returns a pointer to the "\r\n\r\n" that ends the head or nullptr
+        const char* find_head_end(const char* data, std::size_t size)
+        {
+            std::size_t i = scanned;
+            while (i + 4 <= size)
+            {
+                const void* cr = std::memchr(data + i, '\r', size - i - 3);
+                if (cr == nullptr)
+                {
+                    break;
+                }
+                i = static_cast<const char*>(cr) - data;
+                if (std::memcmp(data + i, "\r\n\r\n", 4) == 0)
+                {
+                    return data + i + 2;
+                }
+                i++;
+            }
+            // The last three bytes can still be the start of the terminator
+            scanned = size > 3 ? size - 3 : 0;
+            return nullptr;
+        }
+
+        // Reads a non empty run of bytes up to sep, which may not contain spaces or line breaks
+        static bool token(const char*& pos, const char* end, char sep, std::string_view& out)
+        {
+            const char* start = pos;
+            while (pos < end && *pos != sep)
+            {
+                if (*pos == '\r' || *pos == '\n' || (*pos == ' ' && sep != ' '))
+                {
+                    return false;
+                }
+                pos++;
+            }
+            if (pos == end || pos == start)
+            {
+                return false;
+            }
+            out = std::string_view(start, pos - start);
+            pos++;
+            return true;
+        }
+
+        // Reads the rest of the line and steps over its "\r\n"
+        static bool line(const char*& pos, const char* end, std::string_view& out)
+        {
+            const char* start = pos;
+            while (pos < end && *pos != '\r')
+            {
+                if (*pos == '\n')
+                {
+                    return false;
+                }
+                pos++;
+            }
+            if (pos == end || pos[1] != '\n')
+            {
+                return false;
+            }
+            out = std::string_view(start, pos - start);
+            pos += 2;
+            return true;
+        }
+
+        static std::string_view trim(std::string_view s)
+        {
+            while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+            {
+                s.remove_prefix(1);
+            }
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+            {
+                s.remove_suffix(1);
+            }
+            return s;
+        }
+
+    private:
+        std::size_t scanned = 0;
+};
+
+// True if the If-None-Match list names etag or is "*", weak tags compare by their opaque part
+inline bool etag_matches(std::string_view list, std::string_view etag)
+{
+    while (!list.empty())
+    {
+        std::size_t comma = list.find(',');
+        std::string_view tag = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+
+        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) tag.remove_prefix(1);
+        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) tag.remove_suffix(1);
+        if (tag == "*")
+        {
+            return true;
+        }
+        if (tag.substr(0, 2) == "W/")
+        {
+            tag.remove_prefix(2);
+        }
+        if (!tag.empty() && tag == etag)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// True if an Accept-Encoding value allows coding, either by name or through "*", and does not give it q=0
+inline bool coding_accepted(std::string_view accept, std::string_view coding)
+{
+    bool wildcard = false;
+    while (!accept.empty())
+    {
+        std::size_t comma = accept.find(',');
+        std::string_view item = accept.substr(0, comma);
+        accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+
+        std::size_t semi = item.find(';');
+        std::string_view name = item.substr(0, semi);
+        while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) name.remove_prefix(1);
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) name.remove_suffix(1);
+
+        // Only "q=0", "q=0.", "q=0.0" and so on turn a coding off
+        bool refused = false;
+        if (semi != std::string_view::npos)
+        {
+            std::string_view q = item.substr(semi + 1);
+            while (!q.empty() && (q.front() == ' ' || q.front() == '\t')) q.remove_prefix(1);
+            while (!q.empty() && (q.back() == ' ' || q.back() == '\t')) q.remove_suffix(1);
+            if (q.substr(0, 2) == "q=" || q.substr(0, 2) == "Q=")
+            {
+                q.remove_prefix(2);
+                refused = !q.empty() && q.front() == '0' && q.find_first_not_of("0.", 0) == std::string_view::npos;
+            }
+        }
+
+        if (header_iequals(name, coding))
+        {
+            return !refused;
+        }
+        if (name == "*")
+        {
+            wildcard = !refused;
+        }
+    }
+    return wildcard;
+}
+
+// Reads an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT", the only date format servers send
+inline bool parse_http_date(std::string_view text, std::time_t& out)
+{
+    char date[64];
+    if (text.size() >= sizeof(date))
+    {
+        return false;
+    }
+    std::memcpy(date, text.data(), text.size());
+    date[text.size()] = '\0';
+
+    std::tm utc {};
+    const char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &utc);
+    if (end == nullptr || *end != '\0')
+    {
+        return false;
+    }
+    out = timegm(&utc);
+    return true;
+}
+
+// Digits only, false for an empty string or one that would overflow
+inline bool parse_decimal(std::string_view s, std::uint64_t& out)
+{
+    if (s.empty() || s.size() > 19)
+    {
+        return false;
+    }
+    out = 0;
+    for (char c : s)
+    {
+        if (c < '0' || c > '9')
+        {
+            return false;
+        }
+        out = out * 10 + (c - '0');
+    }
+    return true;
+}
+
+struct Byte_range {
+    std::uint64_t first;
+    std::uint64_t last;
+};
+
+// Ranges asked for with "Range: bytes=...", resolved against the size of the file being sent
+// Ranges that start past the end are left out, a header that does not parse, asks for another unit
+// or asks for more than max_ranges pieces is ignored and the whole file is sent
+struct Byte_ranges {
+    enum Result { none, satisfiable, unsatisfiable };
+
+    static const std::size_t max_ranges = 16;
+
+    std::array<Byte_range, max_ranges> ranges;
+    std::size_t count = 0;
+
+    Result parse(std::string_view value, std::uint64_t size)
+    {
+        count = 0;
+        if (value.substr(0, 6) != "bytes=")
+        {
+            return none;
+        }
+        value.remove_prefix(6);
+
+        std::size_t specs = 0;
+        while (!value.empty())
+        {
+            std::size_t comma = value.find(',');
+            std::string_view spec = trim(value.substr(0, comma));
+            value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+            if (spec.empty())
+            {
+                continue;
+            }
+            if (++specs > max_ranges)
+            {
+                count = 0;
+                return none;
+            }
+
+            std::size_t dash = spec.find('-');
+            if (dash == std::string_view::npos)
+            {
+                count = 0;
+                return none;
+            }
+            std::uint64_t first = 0, last = 0;
+            bool has_first = parse_decimal(spec.substr(0, dash), first);
+            bool has_last = parse_decimal(spec.substr(dash + 1), last);
+
+            if (!has_first)
+            {
+                // "-n" asks for the last n bytes
+                if (!has_last || dash != 0)
+                {
+                    count = 0;
+                    return none;
+                }
+                if (last == 0 || size == 0)
+                {
+                    continue;
+                }
+                first = last < size ? size - last : 0;
+                last = size - 1;
+            }
+            else if (!has_last)
+            {
+                if (dash + 1 != spec.size())
+                {
+                    count = 0;
+                    return none;
+                }
+                last = size - 1;
+            }
+            else if (last < first)
+            {
+                count = 0;
+                return none;
+            }
+
+            if (first >= size)
+            {
+                continue;
+            }
+            ranges[count++] = Byte_range{ first, last < size ? last : size - 1 };
+        }
+
+        if (specs == 0)
+        {
+            return none;
+        }
+        return count > 0 ? satisfiable : unsatisfiable;
+    }
+
+    private:
+        static std::string_view trim(std::string_view s)
+        {
+            while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+            return s;
+        }
+};
+
+class Body_decoder {
+    // Takes the framing off a request body sent with Content-Length or chunked transfer coding
+    // Works on whatever has been received so far, the pieces it returns point into that input so
+    // nothing is copied, and it picks up where it left off when called again with more
+    // Chunk extensions and trailers are read past and dropped
+
+    public:
+        enum Result { piece, need_more, done, bad_body, too_large };
+        enum Framing { no_body, framed, bad_framing, unsupported_coding, framed_too_large };
+
+        // Starts on the body of request as its headers frame it, limit caps the size of the body
+        // A request that gives its length more than once, or gives both a length and a transfer coding,
+        // could be read one way here and another by a proxy in front, which is how requests get
+        // smuggled, so it is bad_framing even when the values agree
+        Framing start(const Http_request& request, std::uint64_t limit)
+        {
+            std::size_t lengths = request.count("Content-Length");
+            std::size_t encodings = request.count("Transfer-Encoding");
+            if (lengths == 0 && encodings == 0)
+            {
+                return no_body;
+            }
+            if (lengths > 1 || encodings > 1 || (lengths != 0 && encodings != 0))
+            {
+                return bad_framing;
+            }
+
+            if (encodings != 0)
+            {
+                if (!header_iequals(request.header("Transfer-Encoding"), "chunked"))
+                {
+                    return unsupported_coding;
+                }
+                start_chunked(limit);
+                return framed;
+            }
+
+            std::uint64_t size;
+            if (!parse_decimal(request.header("Content-Length"), size))
+            {
+                return bad_framing;
+            }
+            if (size > limit)
+            {
+                return framed_too_large;
+            }
+            // An empty body is no body, there is nothing to hand a sink
+            if (size == 0)
+            {
+                return no_body;
+            }
+            start_length(size);
+            return framed;
+        }
+
+        void start_length(std::uint64_t length)
+        {
+            state = length == 0 ? finished : fixed;
+            remaining = length;
+            total = 0;
+        }
+
+        // limit caps the decoded size, a chunked body does not say how big it is up front
+        void start_chunked(std::uint64_t limit)
+        {
+            state = chunk_size;
+            remaining = 0;
+            this->limit = limit;
+            total = 0;
+        }
+
+        // Decoded bytes handed out so far
+        std::uint64_t received() const { return total; }
+
+        // Returns the next piece of body found in data, consumed is how many bytes of data have been
+        // dealt with once the caller is done with the piece
+        Result next(const char* data, std::size_t size, std::size_t& consumed, std::string_view& out)
+        {
+            consumed = 0;
+            out = std::string_view();
+            while (true)
+            {
+                const char* p = data + consumed;
+                std::size_t n = size - consumed;
+
+                if (state == finished)
+                {
+                    return done;
+                }
+
+                if (state == fixed || state == chunk_data)
+                {
+                    if (n == 0)
+                    {
+                        return need_more;
+                    }
+                    std::size_t take = n < remaining ? n : remaining;
+                    out = std::string_view(p, take);
+                    consumed += take;
+                    remaining -= take;
+                    total += take;
+                    if (remaining == 0)
+                    {
+                        state = state == fixed ? finished : chunk_end;
+                    }
+                    return piece;
+                }
+
+                if (state == chunk_end)
+                {
+                    if (n < 2)
+                    {
+                        return need_more;
+                    }
+                    if (p[0] != '\r' || p[1] != '\n')
+                    {
+                        return bad_body;
+                    }
+                    consumed += 2;
+                    state = chunk_size;
+                    continue;
+                }
+
+                const char* eol = find_line_end(p, n);
+                if (eol == nullptr)
+                {
+                    return need_more;
+                }
+                consumed += eol + 2 - p;
+
+                if (state == trailers)
+                {
+                    // The blank line ends the trailers and the body
+                    if (eol == p)
+                    {
+                        state = finished;
+                    }
+                    continue;
+                }
+
+                std::uint64_t chunk = 0;
+                std::size_t digits = 0;
+                for (; p + digits < eol; digits++)
+                {
+                    int value = hex(p[digits]);
+                    if (value < 0)
+                    {
+                        break;
+                    }
+                    chunk = chunk * 16 + value;
+                }
+                if (digits == 0 || digits > 15 || (p + digits < eol && p[digits] != ';' && p[digits] != ' ' && p[digits] != '\t'))
+                {
+                    return bad_body;
+                }
+
+                if (chunk == 0)
+                {
+                    state = trailers;
+                    continue;
+                }
+                if (total + chunk > limit)
+                {
+                    return too_large;
+                }
+                remaining = chunk;
+                state = chunk_data;
+            }
+        }
+
+    private:
+        enum State { finished, fixed, chunk_size, chunk_data, chunk_end, trailers };
+
+        static const char* find_line_end(const char* p, std::size_t n)
+        {
+            for (std::size_t i = 0; i + 1 < n; i++)
+            {
+                if (p[i] == '\r' && p[i + 1] == '\n')
+                {
+                    return p + i;
+                }
+            }
+            return nullptr;
+        }
+
+        static int hex(char c)
+        {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        }
+
+        State state = finished;
+        std::uint64_t remaining = 0;
+        std::uint64_t limit = 0;
+        std::uint64_t total = 0;
+};
+
+#endif  // _HTTPPARSERHEAD_
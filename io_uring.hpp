@@ -0,0 +1,369 @@
+#ifndef _IOURINGHEAD_
+#define _IOURINGHEAD_
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+class Io_ring {
+    // An io_uring submission and completion queue pair, set up with the raw system calls so the
+    // server does not need liburing
+    // Not thread safe, whoever owns the ring decides how it is shared
+
+    public:
+        explicit Io_ring(unsigned int entries)
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+            if (fd < 0)
+            {
+                return;
+            }
+
+            sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+            cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single)
+            {
+                sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+            }
+
+            sq_ring = ::mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            cq_ring = single ? sq_ring : ::mmap(nullptr, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+            if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+            {
+                close();
+                return;
+            }
+
+            char* sq = static_cast<char*>(sq_ring);
+            sq_head = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+            sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+            sq_mask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+            sq_flags = reinterpret_cast<unsigned int*>(sq + params.sq_off.flags);
+            sq_entries = params.sq_entries;
+            // Submission slots are used in order, so the index array never changes
+            unsigned int* array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+            for (unsigned int i = 0; i < sq_entries; i++)
+            {
+                array[i] = i;
+            }
+            sqe_tail = *sq_tail;
+
+            char* cq = static_cast<char*>(cq_ring);
+            cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+            cq_mask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        }
+
+        ~Io_ring()
+        {
+            close();
+        }
+
+        Io_ring(const Io_ring&) = delete;
+        Io_ring& operator=(const Io_ring&) = delete;
+
+        bool is_open() const { return fd >= 0; }
+        int native_handle() const { return fd; }
+
+        // A cleared submission entry, or nullptr when every slot is waiting to be submitted
+        io_uring_sqe* get_sqe()
+        {
+            if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+            {
+                return nullptr;
+            }
+            io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe_tail++;
+            return sqe;
+        }
+
+        // Hands the kernel everything prepared since the last call and waits for wait_for completions,
+        // returns the number submitted or -errno
+        int submit(unsigned int wait_for = 0)
+        {
+            __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+            unsigned int pending = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (pending == 0 && wait_for == 0)
+            {
+                return 0;
+            }
+            int result;
+            do
+            {
+                result = static_cast<int>(::syscall(__NR_io_uring_enter, fd, pending, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+            }
+            while (result < 0 && errno == EINTR);
+            return result < 0 ? -errno : result;
+        }
+
+        // Takes the oldest completion off the queue, false if there is none
+        bool peek(io_uring_cqe& cqe)
+        {
+            unsigned int head = *cq_head;
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            {
+                // Completions that did not fit in the queue are held by the kernel until asked for
+                if (!(__atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW))
+                {
+                    return false;
+                }
+                ::syscall(__NR_io_uring_enter, fd, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+                {
+                    return false;
+                }
+            }
+            cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        int register_eventfd(int event_fd)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &event_fd, 1));
+        }
+
+        // True if the kernel has io_uring and every operation the server uses
+        static bool supported()
+        {
+            static const bool result = []()
+            {
+                Io_ring ring(2);
+                if (!ring.is_open())
+                {
+                    return false;
+                }
+                const unsigned int ops = 256;
+                io_uring_probe* probe = static_cast<io_uring_probe*>(std::calloc(1, sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op)));
+                bool ok = ::syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, ops) >= 0;
+                for (int op : { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE, IORING_OP_ASYNC_CANCEL })
+                {
+                    ok = ok && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+                }
+                std::free(probe);
+                return ok;
+            }();
+            return result;
+        }
+
+    private:
+        void close()
+        {
+            if (sqes != nullptr && sqes != MAP_FAILED)
+            {
+                ::munmap(sqes, sqes_bytes);
+            }
+            if (cq_ring != nullptr && cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            {
+                ::munmap(cq_ring, cq_bytes);
+            }
+            if (sq_ring != nullptr && sq_ring != MAP_FAILED)
+            {
+                ::munmap(sq_ring, sq_bytes);
+            }
+            sqes = nullptr;
+            sq_ring = cq_ring = nullptr;
+            if (fd >= 0)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+    private:
+        int fd = -1;
+        void* sq_ring = nullptr;
+        void* cq_ring = nullptr;
+        io_uring_sqe* sqes = nullptr;
+        std::size_t sq_bytes = 0;
+        std::size_t cq_bytes = 0;
+        std::size_t sqes_bytes = 0;
+
+        unsigned int* sq_head = nullptr;
+        unsigned int* sq_tail = nullptr;
+        unsigned int* sq_flags = nullptr;
+        unsigned int sq_mask = 0;
+        unsigned int sq_entries = 0;
+        // Slots handed out but not yet published to the kernel end here
+        unsigned int sqe_tail = 0;
+
+        unsigned int* cq_head = nullptr;
+        unsigned int* cq_tail = nullptr;
+        unsigned int cq_mask = 0;
+        io_uring_cqe* cqes = nullptr;
+};
+
+class Uring_service {
+    // Socket operations through io_uring for one io_context
+    // Operations prepared while handlers run are submitted together by one io_uring_enter, posted
+    // to run after them, so a busy loop pays one system call for a whole batch of sends and receives
+    // The ring signals an eventfd the io_context waits on, and completions are handed to their
+    // owners from there, the owner keeps the Op and gets the raw result, a byte count or -errno
+
+    public:
+        struct Op {
+            // Called on an io_context thread, must not block
+            void (*complete)(Op* op, int result) = nullptr;
+        };
+
+        Uring_service(boost::asio::io_context& ioc, unsigned int entries = 4096) :
+            ioc(ioc), ring(entries), events(ioc)
+        {
+            // The outcome of a cancel is seen by the operation it cancelled, its own completion is dropped
+            cancelled.complete = [](Op*, int) {};
+            if (!ring.is_open())
+            {
+                return;
+            }
+            int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (event_fd < 0 || ring.register_eventfd(event_fd) < 0)
+            {
+                if (event_fd >= 0)
+                {
+                    ::close(event_fd);
+                }
+                return;
+            }
+            events.assign(event_fd);
+            wait_completions();
+        }
+
+        bool is_open() const { return events.is_open(); }
+
+        // Each operation returns false when the submission queue is still full after the kernel has been
+        // handed what is in it, nothing is started then and the caller goes through epoll instead
+
+        bool accept(int fd, Op& op)
+        {
+            return submit(op, [fd](io_uring_sqe& sqe)
+            {
+                sqe.opcode = IORING_OP_ACCEPT;
+                sqe.fd = fd;
+                sqe.accept_flags = SOCK_CLOEXEC;
+            });
+        }
+
+        bool recv(int fd, void* data, std::size_t size, Op& op)
+        {
+            return submit(op, [fd, data, size](io_uring_sqe& sqe)
+            {
+                sqe.opcode = IORING_OP_RECV;
+                sqe.fd = fd;
+                sqe.addr = reinterpret_cast<std::uint64_t>(data);
+                sqe.len = static_cast<std::uint32_t>(size);
+            });
+        }
+
+        // msg has to stay valid until the operation completes
+        bool sendmsg(int fd, const msghdr* msg, Op& op)
+        {
+            return submit(op, [fd, msg](io_uring_sqe& sqe)
+            {
+                sqe.opcode = IORING_OP_SENDMSG;
+                sqe.fd = fd;
+                sqe.addr = reinterpret_cast<std::uint64_t>(msg);
+                sqe.len = 1;
+                sqe.msg_flags = MSG_NOSIGNAL;
+            });
+        }
+
+        // Asks for op to be cancelled, it then completes with -ECANCELED unless it finished first
+        bool cancel(Op& op)
+        {
+            Op* target = &op;
+            return submit(cancelled, [target](io_uring_sqe& sqe)
+            {
+                sqe.opcode = IORING_OP_ASYNC_CANCEL;
+                sqe.addr = reinterpret_cast<std::uint64_t>(target);
+            });
+        }
+
+        void stop()
+        {
+            boost::system::error_code ignored;
+            events.cancel(ignored);
+        }
+
+    private:
+        template <typename Prepare>
+        bool submit(Op& op, Prepare prepare)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            io_uring_sqe* sqe = ring.get_sqe();
+            if (sqe == nullptr)
+            {
+                // Every slot is taken, send the batch now rather than wait for the flush
+                ring.submit();
+                sqe = ring.get_sqe();
+                if (sqe == nullptr)
+                {
+                    // The kernel took none of it, as it does while its completion queue is backed up
+                    return false;
+                }
+            }
+            prepare(*sqe);
+            sqe->user_data = reinterpret_cast<std::uint64_t>(&op);
+
+            if (!flush_posted)
+            {
+                flush_posted = true;
+                boost::asio::post(ioc, [this]()
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    flush_posted = false;
+                    ring.submit();
+                });
+            }
+            return true;
+        }
+
+        // Only one read of the eventfd is ever outstanding, so completions are taken off by one thread at a time
+        // The count is read before the queue is emptied, a completion arriving after that sets it again
+        void wait_completions()
+        {
+            events.async_read_some(boost::asio::buffer(&signalled, sizeof(signalled)), [this](const boost::system::error_code& ec, std::size_t)
+            {
+                if (ec)
+                {
+                    return;
+                }
+                io_uring_cqe cqe;
+                while (ring.peek(cqe))
+                {
+                    Op* op = reinterpret_cast<Op*>(cqe.user_data);
+                    op->complete(op, cqe.res);
+                }
+                wait_completions();
+            });
+        }
+
+    private:
+        boost::asio::io_context& ioc;
+        Io_ring ring;
+        boost::asio::posix::stream_descriptor events;
+        std::uint64_t signalled = 0;
+        Op cancelled;
+
+        std::mutex mtx;
+        bool flush_posted = false;
+};
+
+#endif  // _IOURINGHEAD_
@@ -0,0 +1,108 @@
+#ifndef _LATENCYHISTOGRAMHEAD_
+#define _LATENCYHISTOGRAMHEAD_
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+// Log-linear histogram of durations in nanoseconds, in the spirit of HdrHistogram
+// Every power of two is split into 32 buckets so any value is stored within about 3%,
+// and recording is a couple of shifts and an increment with no allocation
+// Not thread safe, keep one per thread and merge() them when reporting
+class Latency_histogram {
+    public:
+        static const unsigned int sub_bucket_bits = 5;
+        static const std::size_t sub_buckets = 1 << sub_bucket_bits;
+        // Enough buckets for anything up to 2^44 ns, about four and a half hours
+        static const std::size_t bucket_count = (44 - sub_bucket_bits + 1) * sub_buckets;
+
+        void record(std::uint64_t ns)
+        {
+            counts[index_of(ns)]++;
+            total++;
+            if (ns > max_value)
+            {
+                max_value = ns;
+            }
+        }
+
+        void merge(const Latency_histogram& other)
+        {
+            for (std::size_t i = 0; i < bucket_count; i++)
+            {
+                counts[i] += other.counts[i];
+            }
+            total += other.total;
+            if (other.max_value > max_value)
+            {
+                max_value = other.max_value;
+            }
+        }
+
+        void clear()
+        {
+            counts.fill(0);
+            total = 0;
+            max_value = 0;
+        }
+
+        // Smallest recorded value that q (0 to 1) of all values are at or below, 0 if empty
+        std::uint64_t percentile(double q) const
+        {
+            if (total == 0)
+            {
+                return 0;
+            }
+            std::uint64_t rank = static_cast<std::uint64_t>(q * total + 0.5);
+            if (rank == 0)
+            {
+                rank = 1;
+            }
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < bucket_count; i++)
+            {
+                seen += counts[i];
+                if (seen >= rank)
+                {
+                    std::uint64_t value = upper_bound_of(i);
+                    return value < max_value ? value : max_value;
+                }
+            }
+            return max_value;
+        }
+
+        std::uint64_t count() const { return total; }
+        std::uint64_t max() const { return max_value; }
+        std::uint64_t bucket(std::size_t i) const { return counts[i]; }
+
+        // Largest value that lands in bucket i
+        static std::uint64_t upper_bound_of(std::size_t i)
+        {
+            if (i < sub_buckets)
+            {
+                return i;
+            }
+            unsigned int shift = i / sub_buckets - 1;
+            std::uint64_t base = (i % sub_buckets) + sub_buckets;
+            return ((base + 1) << shift) - 1;
+        }
+
+        static std::size_t index_of(std::uint64_t ns)
+        {
+            if (ns < sub_buckets)
+            {
+                return ns;
+            }
+            unsigned int msb = 63 - __builtin_clzll(ns);
+            unsigned int shift = msb - sub_bucket_bits;
+            std::size_t i = (shift + 1) * sub_buckets + ((ns >> shift) - sub_buckets);
+            return i < bucket_count ? i : bucket_count - 1;
+        }
+
+    private:
+        std::array<std::uint64_t, bucket_count> counts {};
+        std::uint64_t total = 0;
+        std::uint64_t max_value = 0;
+};
+
+#endif  // _LATENCYHISTOGRAMHEAD_
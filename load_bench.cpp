@@ -0,0 +1,410 @@
+// Load generator and latency benchmark for the server variants
+// Opens a number of connections spread over a few threads, drives a GET/POST mix at the server
+// and prints one JSON object with the throughput and latency percentiles
+//
+// Closed loop (default): every connection sends its next request as soon as the last one is answered
+// Fixed rate (--rate=N): requests are scheduled at N per second across all connections and latency is
+// measured from when a request was due rather than when it went out, so a stalled server is not
+// hidden by the client waiting for it (coordinated omission)
+//
+// Pipelined (--pipeline=N): every connection writes N requests at once and reads the N responses back,
+// each response is timed from when the batch went out
+//
+// Build: g++ -std=c++17 -O2 load_bench.cpp -lboost_system -lpthread -o load_bench
+// Run:   ./load_bench --port=1333 --connections=64 --threads=4 --duration=10 --path=/home.html
+
+#include "latency_histogram.hpp"
+
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace boost;
+
+struct Bench_options {
+    std::string host = "127.0.0.1";
+    unsigned short port = 1333;
+    unsigned int connections = 64;
+    unsigned int threads = 2;
+    double duration = 10;
+    double warmup = 1;
+    // Requests per second across all connections, 0 runs closed loop
+    double rate = 0;
+    std::string path = "/home.html";
+    std::string label;
+    // Share of requests sent as POST, with post_bytes of body
+    double post_ratio = 0;
+    std::size_t post_bytes = 128;
+    bool keep_alive = true;
+    // Requests written back to back before waiting for their responses, needs keep-alive
+    unsigned int pipeline = 1;
+};
+
+// Results of one thread, merged when the run ends
+struct Bench_stats {
+    Latency_histogram latency;
+    std::uint64_t requests = 0;
+    std::uint64_t errors = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t connects = 0;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+class Bench_connection {
+    // Sends requests on one connection and times every response
+
+    public:
+        Bench_connection(asio::io_context& ioc, const Bench_options& options, const asio::ip::tcp::endpoint& endpoint,
+                         Bench_stats& stats, bench_clock::time_point measure_from, bench_clock::time_point end,
+                         bench_clock::duration interval, unsigned int seed) :
+            options(options), endpoint(endpoint), stats(stats), sock(ioc), timer(ioc),
+            measure_from(measure_from), end(end), interval(interval), random(seed)
+        {
+            // Spread the first request of every connection over one interval so fixed rate starts smoothly
+            next_due = bench_clock::now() + std::chrono::duration_cast<bench_clock::duration>(interval * std::uniform_real_distribution<double>(0, 1)(random));
+
+            std::string body(options.post_bytes, 'x');
+            std::string connection = options.keep_alive ? "keep-alive" : "close";
+            get_request = "GET " + options.path + " HTTP/1.1\r\nHost: " + options.host + "\r\nConnection: " + connection + "\r\n\r\n";
+            post_request = "POST " + options.path + " HTTP/1.1\r\nHost: " + options.host + "\r\nConnection: " + connection
+                + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        }
+
+        void start()
+        {
+            connect();
+        }
+
+    private:
+        void connect()
+        {
+            boost::system::error_code ignored;
+            sock.close(ignored);
+            sock.async_connect(endpoint, [this](const boost::system::error_code& ec)
+            {
+                if (ec)
+                {
+                    failed();
+                    return;
+                }
+                stats.connects++;
+                sock.set_option(asio::ip::tcp::no_delay(true));
+                schedule();
+            });
+        }
+
+        // Closed loop sends right away, fixed rate waits until the next request is due
+        void schedule()
+        {
+            if (bench_clock::now() >= end)
+            {
+                boost::system::error_code ignored;
+                sock.close(ignored);
+                return;
+            }
+
+            if (options.rate <= 0)
+            {
+                send(bench_clock::now());
+                return;
+            }
+
+            bench_clock::time_point due = next_due;
+            next_due += interval;
+            if (due <= bench_clock::now())
+            {
+                send(due);
+                return;
+            }
+            timer.expires_at(due);
+            timer.async_wait([this, due](const boost::system::error_code& ec)
+            {
+                if (!ec)
+                {
+                    send(due);
+                }
+            });
+        }
+
+        void send(bench_clock::time_point due)
+        {
+            started = due;
+            bool post = options.post_ratio > 0 && std::uniform_real_distribution<double>(0, 1)(random) < options.post_ratio;
+            batch.assign(post ? post_request : get_request);
+            outstanding = 1;
+            while (options.keep_alive && outstanding < options.pipeline)
+            {
+                post = options.post_ratio > 0 && std::uniform_real_distribution<double>(0, 1)(random) < options.post_ratio;
+                batch.append(post ? post_request : get_request);
+                outstanding++;
+            }
+
+            asio::async_write(sock, asio::buffer(batch), [this](const boost::system::error_code& ec, std::size_t)
+            {
+                if (ec)
+                {
+                    failed();
+                    return;
+                }
+                read_head();
+            });
+        }
+
+        void read_head()
+        {
+            asio::async_read_until(sock, response, "\r\n\r\n", [this](const boost::system::error_code& ec, std::size_t head)
+            {
+                if (ec)
+                {
+                    failed();
+                    return;
+                }
+                on_head(head);
+            });
+        }
+
+        void on_head(std::size_t head)
+        {
+            std::string text(asio::buffers_begin(response.data()), asio::buffers_begin(response.data()) + head);
+            response.consume(head);
+
+            std::size_t body = 0;
+            close_after = !options.keep_alive;
+            std::size_t pos = 0;
+            while ((pos = text.find("\r\n", pos)) != std::string::npos)
+            {
+                pos += 2;
+                std::size_t colon = text.find(':', pos);
+                std::size_t eol = text.find("\r\n", pos);
+                if (colon == std::string::npos || eol == std::string::npos || colon > eol)
+                {
+                    continue;
+                }
+                std::string name = text.substr(pos, colon - pos);
+                std::string value = text.substr(colon + 1, eol - colon - 1);
+                for (auto& c : name)
+                {
+                    c = std::tolower(c);
+                }
+                if (name == "content-length")
+                {
+                    body = std::stoul(value);
+                }
+                else if (name == "connection" && value.find("close") != std::string::npos)
+                {
+                    close_after = true;
+                }
+            }
+
+            error_status = text.compare(0, 9, "HTTP/1.1 ") != 0 || (text[9] != '2' && text[9] != '3');
+            stats.bytes += head + body;
+            read_body(body);
+        }
+
+        void read_body(std::size_t remaining)
+        {
+            std::size_t buffered = std::min(remaining, response.size());
+            response.consume(buffered);
+            remaining -= buffered;
+
+            if (remaining == 0)
+            {
+                finished();
+                return;
+            }
+
+            asio::async_read(sock, response, asio::transfer_at_least(1), [this, remaining](const boost::system::error_code& ec, std::size_t)
+            {
+                if (ec)
+                {
+                    failed();
+                    return;
+                }
+                read_body(remaining);
+            });
+        }
+
+        void finished()
+        {
+            bench_clock::time_point now = bench_clock::now();
+            if (now >= measure_from && now < end)
+            {
+                stats.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - started).count());
+                stats.requests++;
+                if (error_status)
+                {
+                    stats.errors++;
+                }
+            }
+
+            if (close_after)
+            {
+                response.consume(response.size());
+                connect();
+                return;
+            }
+            if (--outstanding > 0)
+            {
+                read_head();
+                return;
+            }
+            schedule();
+        }
+
+        void failed()
+        {
+            if (bench_clock::now() >= measure_from && bench_clock::now() < end)
+            {
+                stats.errors++;
+            }
+            response.consume(response.size());
+            if (bench_clock::now() < end)
+            {
+                connect();
+            }
+        }
+
+    private:
+        const Bench_options& options;
+        asio::ip::tcp::endpoint endpoint;
+        Bench_stats& stats;
+        asio::ip::tcp::socket sock;
+        asio::steady_timer timer;
+        asio::streambuf response;
+        std::string get_request;
+        std::string post_request;
+        std::string batch;
+        unsigned int outstanding = 0;
+
+        bench_clock::time_point measure_from;
+        bench_clock::time_point end;
+        bench_clock::duration interval;
+        bench_clock::time_point next_due;
+        bench_clock::time_point started;
+        std::mt19937 random;
+        bool close_after = false;
+        bool error_status = false;
+};
+
+bool Parse_options(int argc, char* argv[], Bench_options& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        std::size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+
+        try
+        {
+            if (name == "--host") options.host = value;
+            else if (name == "--port") options.port = std::stoul(value);
+            else if (name == "--connections") options.connections = std::stoul(value);
+            else if (name == "--threads") options.threads = std::stoul(value);
+            else if (name == "--duration") options.duration = std::stod(value);
+            else if (name == "--warmup") options.warmup = std::stod(value);
+            else if (name == "--rate") options.rate = std::stod(value);
+            else if (name == "--path") options.path = value;
+            else if (name == "--label") options.label = value;
+            else if (name == "--post-ratio") options.post_ratio = std::stod(value);
+            else if (name == "--post-bytes") options.post_bytes = std::stoul(value);
+            else if (name == "--no-keep-alive") options.keep_alive = false;
+            else if (name == "--pipeline") options.pipeline = std::max(1ul, std::stoul(value));
+            else
+            {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "Invalid value for " << name << ": " << value << std::endl;
+            return false;
+        }
+    }
+    return options.connections > 0 && options.threads > 0 && options.duration > 0;
+}
+
+int main(int argc, char* argv[])
+{
+    Bench_options options;
+    if (!Parse_options(argc, argv, options))
+    {
+        return 1;
+    }
+
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(options.host), options.port);
+
+    bench_clock::time_point start = bench_clock::now();
+    bench_clock::time_point measure_from = start + std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(options.warmup));
+    bench_clock::time_point end = measure_from + std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(options.duration));
+
+    // Each connection gets an equal share of the target rate
+    bench_clock::duration interval = bench_clock::duration::zero();
+    if (options.rate > 0)
+    {
+        interval = std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(options.connections / options.rate));
+    }
+
+    std::vector<std::unique_ptr<asio::io_context>> contexts;
+    std::vector<std::unique_ptr<Bench_stats>> stats;
+    std::vector<std::unique_ptr<Bench_connection>> connections;
+    for (unsigned int t = 0; t < options.threads; t++)
+    {
+        contexts.emplace_back(new asio::io_context(1));
+        stats.emplace_back(new Bench_stats());
+    }
+    for (unsigned int c = 0; c < options.connections; c++)
+    {
+        unsigned int t = c % options.threads;
+        connections.emplace_back(new Bench_connection(*contexts[t], options, endpoint, *stats[t], measure_from, end, interval, c + 1));
+        connections.back()->start();
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& ioc : contexts)
+    {
+        asio::io_context* context = ioc.get();
+        threads.emplace_back([context, end]()
+        {
+            // Connections that are stuck waiting on the server are abandoned at the end of the run
+            context->run_until(end + std::chrono::seconds(1));
+        });
+    }
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    Bench_stats total;
+    for (auto& s : stats)
+    {
+        total.latency.merge(s->latency);
+        total.requests += s->requests;
+        total.errors += s->errors;
+        total.bytes += s->bytes;
+        total.connects += s->connects;
+    }
+
+    auto us = [&](double q) { return total.latency.percentile(q) / 1000.0; };
+    std::printf("{\"label\":\"%s\",\"mode\":\"%s\",\"path\":\"%s\",\"connections\":%u,\"threads\":%u,"
+                "\"duration_s\":%.3f,\"target_rate\":%.1f,\"post_ratio\":%.3f,\"keep_alive\":%s,\"pipeline\":%u,"
+                "\"requests\":%llu,\"errors\":%llu,\"connects\":%llu,\"bytes\":%llu,\"throughput_rps\":%.1f,"
+                "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+                options.label.c_str(), options.rate > 0 ? "fixed_rate" : "closed_loop", options.path.c_str(),
+                options.connections, options.threads, options.duration, options.rate, options.post_ratio,
+                options.keep_alive ? "true" : "false", options.keep_alive ? options.pipeline : 1,
+                (unsigned long long)total.requests, (unsigned long long)total.errors, (unsigned long long)total.connects,
+                (unsigned long long)total.bytes, total.requests / options.duration,
+                us(0.5), us(0.9), us(0.99), us(0.999), total.latency.max() / 1000.0);
+    return 0;
+}
@@ -1,15 +1,18 @@
-#include "server6.hpp"
+#include "server7.hpp"
 
 
 const unsigned int Default_thread_pool_size = 5;
 
-void LogCreate(unsigned int thread_pool_size)
+void LogCreate(unsigned int thread_pool_size, bool block_when_full)
 {
     try
     {
         //Intilises the log thread pool
         spdlog::init_thread_pool(8192, thread_pool_size);
 
+        //When the sinks fall behind the oldest messages are dropped so request threads never wait on the disk
+        auto overflow = block_when_full ? spdlog::async_overflow_policy::block : spdlog::async_overflow_policy::overrun_oldest;
+
         //Sets the sink with colours
         auto stdout_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt >();
         //Sets sink size alognside maximum amount of files
@@ -17,8 +20,8 @@ void LogCreate(unsigned int thread_pool_size)
         std::vector<spdlog::sink_ptr> sinks {stdout_sink, rotating_sink};
 
         // Assigns boths Server Log and Client Log to the same output file "SystemsLogs.txt"
-        auto Server_logger = std::make_shared<spdlog::async_logger>("Server", sinks.begin(), sinks.end(), spdlog::thread_pool(), spdlog::async_overflow_policy::block);
-        auto Client_logger = std::make_shared<spdlog::async_logger>("Client", sinks.begin(), sinks.end(), spdlog::thread_pool(), spdlog::async_overflow_policy::block);
+        auto Server_logger = std::make_shared<spdlog::async_logger>("Server", sinks.begin(), sinks.end(), spdlog::thread_pool(), overflow);
+        auto Client_logger = std::make_shared<spdlog::async_logger>("Client", sinks.begin(), sinks.end(), spdlog::thread_pool(), overflow);
 
         //Registers the logs to be accesssed Globally 
         spdlog::register_logger(Server_logger);
@@ -31,8 +34,159 @@ void LogCreate(unsigned int thread_pool_size)
 
 }
 
-int main()
+// Reads "--name=value" startup options into the server options, unknown options are reported and ignored
+void Parse_options(int argc, char* argv[], Server_options& options)
 {
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg(argv[i]);
+        std::size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+
+        try
+        {
+            if (name == "--keep-alive-timeout-ms")
+            {
+                options.keep_alive_timeout = std::chrono::milliseconds(std::stoul(value));
+            }
+            else if (name == "--header-timeout-ms")
+            {
+                options.header_timeout = std::chrono::milliseconds(std::stoul(value));
+            }
+            else if (name == "--body-timeout-ms")
+            {
+                options.body_timeout = std::chrono::milliseconds(std::stoul(value));
+            }
+            else if (name == "--write-timeout-ms")
+            {
+                options.write_timeout = std::chrono::milliseconds(std::stoul(value));
+            }
+            else if (name == "--handler-timeout-ms")
+            {
+                options.handler_timeout = std::chrono::milliseconds(std::stoul(value));
+            }
+            else if (name == "--max-body-bytes")
+            {
+                options.max_body_bytes = std::stoull(value);
+            }
+            else if (name == "--max-keep-alive-requests")
+            {
+                options.max_keep_alive_requests = std::stoul(value);
+            }
+            else if (name == "--threads")
+            {
+                options.threads = std::stoul(value);
+            }
+            else if (name == "--worker-threads")
+            {
+                options.worker_threads = std::stoul(value);
+            }
+            else if (name == "--worker-queue-depth")
+            {
+                options.worker_queue_depth = std::stoul(value);
+            }
+            else if (name == "--io-context-per-thread")
+            {
+                options.io_context_per_thread = true;
+            }
+            else if (name == "--access-log")
+            {
+                options.access_log_path = value;
+            }
+            else if (name == "--log-block-when-full")
+            {
+                options.log_block_when_full = true;
+            }
+            else if (name == "--no-background-compression")
+            {
+                options.background_compression = false;
+            }
+            else if (name == "--metrics-path")
+            {
+                options.metrics_path = value;
+            }
+            else if (name == "--trace-sample")
+            {
+                options.trace_sample = std::stoul(value);
+            }
+            else if (name == "--trace-path")
+            {
+                options.trace_path = value;
+            }
+            else if (name == "--response-cache-entries")
+            {
+                options.response_cache_entries = std::stoul(value);
+            }
+            else if (name == "--document-root")
+            {
+                options.document_root = value;
+            }
+            else if (name == "--handoff-socket")
+            {
+                options.handoff_path = value;
+            }
+            else if (name == "--drain-timeout-ms")
+            {
+                options.drain_timeout = std::chrono::milliseconds(std::stoul(value));
+            }
+            else if (name == "--accepts-in-flight")
+            {
+                options.accepts_in_flight = std::stoul(value);
+            }
+            else if (name == "--listen-backlog")
+            {
+                options.listen_backlog = std::stoi(value);
+            }
+            else if (name == "--no-tcp-nodelay")
+            {
+                options.tcp_nodelay = false;
+            }
+            else if (name == "--tcp-defer-accept-s")
+            {
+                options.tcp_defer_accept = std::stoi(value);
+            }
+            else if (name == "--tcp-fastopen")
+            {
+                options.tcp_fastopen = std::stoi(value);
+            }
+            else if (name == "--max-connections")
+            {
+                options.max_connections = std::stoul(value);
+            }
+            else if (name == "--max-connections-per-ip")
+            {
+                options.max_connections_per_ip = std::stoul(value);
+            }
+            else if (name == "--when-full" && (value == "pause" || value == "reject"))
+            {
+                options.reject_when_full = value == "reject";
+            }
+            else if (name == "--io-backend" && (value == "io_uring" || value == "epoll"))
+            {
+                options.io_uring = value == "io_uring";
+            }
+            else if (name == "--service" && (value == "coroutine" || value == "callback"))
+            {
+                options.coroutine_service = value == "coroutine";
+            }
+            else
+            {
+                std::cout << "Unknown option " << arg << std::endl;
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            std::cout << "Invalid value for " << name << ": " << value << std::endl;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Server_options options;
+    Parse_options(argc, argv, options);
+
     prctl(PR_SET_NO_NEW_PRIVS, 1);
     prctl(PR_SET_DUMPABLE, 0);
 
@@ -56,16 +210,39 @@ int main()
 
 
 
-    int Port;
-    std::cout << "Please Enter a Port Number: " << std::endl;
-    std::cin >> Port;
+    // A server already running with the same handoff socket passes its listening sockets over,
+    // there is no port to ask for then
+    Handoff inherited;
+    if (!options.handoff_path.empty())
+    {
+        inherited = Handoff::receive(options.handoff_path);
+    }
+
+    int Port = 0;
+    if (inherited.fds.empty())
+    {
+        std::cout << "Please Enter a Port Number: " << std::endl;
+        std::cin >> Port;
+    }
     unsigned short port(Port);
     try 
     {
-        Server srv;
+        Server srv(options);
+        srv.Inherit(std::move(inherited));
 
         unsigned int thread_pool_size = std::thread::hardware_concurrency() * 2;
 
+        //One thread per core is enough when each thread has its own io_context
+        if(options.io_context_per_thread)
+        {
+            thread_pool_size = std::thread::hardware_concurrency();
+        }
+
+        if(options.threads > 0)
+        {
+            thread_pool_size = options.threads;
+        }
+
         if(thread_pool_size == 0)
         {
             thread_pool_size = Default_thread_pool_size;
@@ -73,22 +250,29 @@ int main()
         
         
 
-        LogCreate(thread_pool_size);
+        LogCreate(thread_pool_size, options.log_block_when_full);
         srv.Start(port, thread_pool_size);
 
         //std::this_thread::sleep_for(std::chrono::seconds(60));
-        while(true)
+        //the console is read on its own thread, the server also stops by itself after handing over to a new process
+        std::thread console([&srv]()
         {
             std::string Input;
             //Read Console input
-            std::getline(std::cin, Input);
-            //Process Input
-            if(Input == "Stop")
+            while (std::getline(std::cin, Input))
             {
-                srv.Stop();
-                break;
+                //Process Input
+                if(Input == "Stop")
+                {
+                    srv.Request_stop();
+                    return;
+                }
             }
-        }
+        });
+        console.detach();
+
+        srv.Wait();
+        srv.Stop();
 
     }
     catch (system::system_error&e)
@@ -0,0 +1,182 @@
+#ifndef _METRICSHEAD_
+#define _METRICSHEAD_
+
+#include "latency_histogram.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class Metrics {
+    // Server counters, gauges and the request latency histogram
+    // Every thread updates its own cache line aligned shard with plain relaxed stores, nothing is
+    // shared or locked while a request is served, the shards are only added up when snapshot() is called
+    // Gauges such as active connections are kept as per-thread deltas, since a connection may be
+    // opened on one thread and closed on another, and only their sum means anything
+
+    public:
+        // Response counts are kept per slot of the server's status table
+        static const std::size_t status_slots = 32;
+
+        struct Snapshot {
+            std::uint64_t accepts = 0;
+            std::uint64_t accept_errors = 0;
+            std::uint64_t rejects = 0;
+            std::int64_t active = 0;
+            std::uint64_t bytes_in = 0;
+            std::uint64_t bytes_out = 0;
+            std::array<std::uint64_t, status_slots> responses {};
+            std::array<std::uint64_t, Latency_histogram::bucket_count> latency {};
+            std::uint64_t latency_count = 0;
+            std::uint64_t latency_sum_ns = 0;
+        };
+
+        void connection_opened()
+        {
+            Shard& s = shard();
+            bump(s.accepts, 1);
+            bump(s.active, 1);
+        }
+
+        void connection_closed()
+        {
+            bump(shard().active, -1);
+        }
+
+        void accept_failed()
+        {
+            bump(shard().accept_errors, 1);
+        }
+
+        void connection_rejected()
+        {
+            bump(shard().rejects, 1);
+        }
+
+        void received(std::uint64_t bytes)
+        {
+            bump(shard().bytes_in, bytes);
+        }
+
+        void responded(std::size_t status_slot, std::uint64_t bytes, std::uint64_t latency_ns)
+        {
+            Shard& s = shard();
+            bump(s.responses[status_slot < status_slots ? status_slot : status_slots - 1], 1);
+            bump(s.bytes_out, bytes);
+            bump(s.latency[Latency_histogram::index_of(latency_ns)], 1);
+            bump(s.latency_count, 1);
+            bump(s.latency_sum_ns, latency_ns);
+        }
+
+        Snapshot snapshot() const
+        {
+            Snapshot total;
+            std::lock_guard<std::mutex> lock(shards_mtx);
+            for (auto& s : shards)
+            {
+                total.accepts += s->accepts.load(std::memory_order_relaxed);
+                total.accept_errors += s->accept_errors.load(std::memory_order_relaxed);
+                total.rejects += s->rejects.load(std::memory_order_relaxed);
+                total.active += s->active.load(std::memory_order_relaxed);
+                total.bytes_in += s->bytes_in.load(std::memory_order_relaxed);
+                total.bytes_out += s->bytes_out.load(std::memory_order_relaxed);
+                for (std::size_t i = 0; i < status_slots; i++)
+                {
+                    total.responses[i] += s->responses[i].load(std::memory_order_relaxed);
+                }
+                for (std::size_t i = 0; i < Latency_histogram::bucket_count; i++)
+                {
+                    total.latency[i] += s->latency[i].load(std::memory_order_relaxed);
+                }
+                total.latency_count += s->latency_count.load(std::memory_order_relaxed);
+                total.latency_sum_ns += s->latency_sum_ns.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+    private:
+        struct alignas(64) Shard {
+            std::atomic<std::uint64_t> accepts { 0 };
+            std::atomic<std::uint64_t> accept_errors { 0 };
+            std::atomic<std::uint64_t> rejects { 0 };
+            std::atomic<std::int64_t> active { 0 };
+            std::atomic<std::uint64_t> bytes_in { 0 };
+            std::atomic<std::uint64_t> bytes_out { 0 };
+            std::atomic<std::uint64_t> responses[status_slots] = {};
+            std::atomic<std::uint64_t> latency[Latency_histogram::bucket_count] = {};
+            std::atomic<std::uint64_t> latency_count { 0 };
+            std::atomic<std::uint64_t> latency_sum_ns { 0 };
+        };
+
+        // Only the owning thread writes a shard, so a load and store is enough and avoids a locked add
+        template <typename T, typename D>
+        static void bump(std::atomic<T>& value, D delta)
+        {
+            value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        }
+
+        Shard& shard()
+        {
+            thread_local const Metrics* owner = nullptr;
+            thread_local Shard* current = nullptr;
+            if (owner != this)
+            {
+                std::lock_guard<std::mutex> lock(shards_mtx);
+                shards.emplace_back(new Shard());
+                current = shards.back().get();
+                owner = this;
+            }
+            return *current;
+        }
+
+    private:
+        mutable std::mutex shards_mtx;
+        std::vector<std::unique_ptr<Shard>> shards;
+};
+
+// Accept queue figures the kernel keeps, read when the metrics are scraped
+// queued and backlog add up the server's own listening sockets, overflows and drops count connections
+// the kernel turned away because an accept queue was full, for the whole network namespace
+struct Listen_stats {
+    std::uint64_t queued = 0;
+    std::uint64_t backlog = 0;
+    std::uint64_t overflows = 0;
+    std::uint64_t drops = 0;
+
+    // Fills in overflows and drops from the TcpExt lines of /proc/net/netstat, a name line then a value line
+    void read_netstat()
+    {
+        std::ifstream netstat("/proc/net/netstat");
+        std::string names, values;
+        while (std::getline(netstat, names) && std::getline(netstat, values))
+        {
+            if (names.compare(0, 7, "TcpExt:") != 0)
+            {
+                continue;
+            }
+            std::istringstream name_words(names), value_words(values);
+            std::string name, value;
+            while (name_words >> name && value_words >> value)
+            {
+                if (name == "ListenOverflows")
+                {
+                    overflows = std::stoull(value);
+                }
+                else if (name == "ListenDrops")
+                {
+                    drops = std::stoull(value);
+                }
+            }
+            return;
+        }
+    }
+};
+
+#endif  // _METRICSHEAD_
@@ -0,0 +1,143 @@
+// Microbenchmark of request head parsing: the istream/getline/map code the Service used to run
+// against Http_parser working over the same asio::streambuf bytes
+// Build: g++ -std=c++17 -O2 parser_bench.cpp -lpthread -o parser_bench
+
+#include "http_parser.hpp"
+
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+
+using namespace boost;
+
+// Every allocation made while a benchmark runs is counted
+static std::atomic<std::size_t> allocations(0);
+
+void* operator new(std::size_t size)
+{
+    allocations++;
+    void* p = std::malloc(size);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+const std::string sample_request =
+    "GET /assets/app.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-GB,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n";
+
+// Copies the sample into the streambuf the way a socket read would
+void fill(asio::streambuf& buf)
+{
+    auto space = buf.prepare(sample_request.size());
+    std::memcpy(space.data(), sample_request.data(), sample_request.size());
+    buf.commit(sample_request.size());
+}
+
+// The old code path of Service::http_request() and http_request_header()
+std::size_t parse_with_streams(asio::streambuf& buf)
+{
+    std::string r_line;
+    std::istream r_stream(&buf);
+    std::getline(r_stream, r_line, '\r');
+    r_stream.get();
+    std::string r_method, url, version;
+    std::istringstream r_line_stream(r_line);
+    r_line_stream >> r_method >> url >> version;
+
+    std::map<std::string, std::string> request_header;
+    std::string h_value, h_name;
+    while (!r_stream.eof())
+    {
+        std::getline(r_stream, h_name, ':');
+        if (!r_stream.eof())
+        {
+            std::getline(r_stream, h_value, '\r');
+            r_stream.get();
+            request_header[h_name] = h_value;
+        }
+    }
+    return request_header.size() + url.size();
+}
+
+std::size_t parse_with_parser(asio::streambuf& buf, Http_parser& parser, Http_request& req)
+{
+    auto data = buf.data();
+    parser.parse(static_cast<const char*>(data.data()), data.size(), req);
+    buf.consume(req.length);
+    return req.header_count + req.target.size();
+}
+
+template <typename Parse>
+void run(const char* name, std::size_t iterations, Parse parse)
+{
+    asio::streambuf buf(4096);
+    std::size_t sink = 0;
+
+    // Warm up so the streambuf has its storage before counting
+    for (int i = 0; i < 1000; i++)
+    {
+        fill(buf);
+        sink += parse(buf);
+    }
+
+    std::size_t allocations_before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iterations; i++)
+    {
+        fill(buf);
+        sink += parse(buf);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    std::size_t allocated = allocations.load() - allocations_before;
+
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    std::cout << name << ": " << ns << " ns/request, "
+              << static_cast<double>(allocated) / iterations << " allocations/request"
+              << " (checksum " << sink << ")" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1000000;
+
+    run("istream + map", iterations, [](asio::streambuf& buf)
+    {
+        return parse_with_streams(buf);
+    });
+
+    Http_parser parser;
+    Http_request req;
+    run("Http_parser  ", iterations, [&](asio::streambuf& buf)
+    {
+        return parse_with_parser(buf, parser, req);
+    });
+
+    return 0;
+}
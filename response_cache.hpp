@@ -0,0 +1,272 @@
+#ifndef _RESPONSECACHEHEAD_
+#define _RESPONSECACHEHEAD_
+
+#include "file_cache.hpp"
+#include "http_parser.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// How the responses of a handler route are cached, a ttl of 0 leaves the route uncached
+// The handler of a cached route runs on the worker pool, so unlike other handlers it may block
+struct Cache_policy {
+    // How long a response is served as it is
+    std::chrono::milliseconds ttl { 0 };
+    // How long after that it is still served while a single request renders the next one
+    std::chrono::milliseconds stale { 0 };
+    // Request headers whose values go into the key, for handlers that answer differently on them
+    std::vector<std::string> vary;
+};
+
+class Response_cache {
+    // Responses of cached handler routes, kept for a short time so a burst of the same request runs
+    // the handler once
+    // A key only ever has one render in flight: a request that misses while one runs waits for it
+    // instead of starting its own, and a stale response is served as it is while the first request
+    // to find it stale renders the next one
+    // Waiters hold on to the render itself rather than the entry, so the response reaches them even
+    // if the entry is dropped to make room before they ask for it
+    // Entries live in a hash map split into shards, each with its own lock, like Admission
+    // Only GET requests are cached
+
+    public:
+        typedef std::function<void(std::shared_ptr<const Cached_file> response)> Waiter;
+
+        // A render in flight, the requests waiting for it are called once it is filled
+        class Render {
+            public:
+                explicit Render(const std::string& key) : key(key) {}
+
+                const std::string key;
+
+            private:
+                friend class Response_cache;
+
+                std::mutex mtx;
+                bool done = false;
+                std::shared_ptr<const Cached_file> response;
+                std::vector<Waiter> waiters;
+        };
+        typedef std::shared_ptr<Render> Pending;
+
+        // hit, stale and refresh hand back a response, refresh and miss hand back the render for the
+        // caller to run and fill(), coalesced and miss leave the caller to wait() for that render
+        enum Outcome { hit, stale, refresh, coalesced, miss };
+
+        struct Counters {
+            std::uint64_t hits = 0;
+            std::uint64_t stale = 0;
+            std::uint64_t misses = 0;
+            std::uint64_t coalesced = 0;
+            std::size_t entries = 0;
+        };
+
+        // max_entries is shared out between the shards, each keeps at least one
+        explicit Response_cache(std::size_t max_entries) :
+            shard_entries(max_entries / shard_count > 0 ? max_entries / shard_count : 1)
+        {
+        }
+
+        // Writes the key of request to key: the method, the target with its query and the values of the
+        // policy's vary headers
+        // key keeps its capacity from one request to the next, so after the first few this does not allocate
+        static void make_key(const Http_request& request, const Cache_policy& policy, std::string& key)
+        {
+            key.assign(request.method.data(), request.method.size());
+            key.push_back(' ');
+            std::string_view target = request.target.substr(0, request.target.find('#'));
+            key.append(target.data(), target.size());
+            for (const std::string& name : policy.vary)
+            {
+                std::string_view value = request.header(name);
+                key.push_back('\n');
+                key.append(value.data(), value.size());
+            }
+        }
+
+        Outcome lookup(const std::string& key, std::shared_ptr<const Cached_file>& response, Pending& pending)
+        {
+            auto now = std::chrono::steady_clock::now();
+            Shard& shard = shard_of(key);
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            auto it = shard.entries.find(key);
+            if (it != shard.entries.end() && it->second.response && now < it->second.stale_until)
+            {
+                Entry& entry = it->second;
+                response = entry.response;
+                if (now < entry.fresh_until)
+                {
+                    hits.fetch_add(1, std::memory_order_relaxed);
+                    return hit;
+                }
+                stale_served.fetch_add(1, std::memory_order_relaxed);
+                if (entry.render)
+                {
+                    return stale;
+                }
+                entry.render = std::make_shared<Render>(key);
+                pending = entry.render;
+                return refresh;
+            }
+
+            if (it == shard.entries.end())
+            {
+                make_room(shard, now);
+                it = shard.entries.emplace(key, Entry()).first;
+                entries.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (it->second.render)
+            {
+                pending = it->second.render;
+                coalesced_misses.fetch_add(1, std::memory_order_relaxed);
+                return coalesced;
+            }
+            it->second.render = std::make_shared<Render>(key);
+            pending = it->second.render;
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return miss;
+        }
+
+        // Calls waiter with the response once pending is filled, straight away on this thread if it is
+        // filled already, a render that failed gives a null response
+        static void wait(const Pending& pending, Waiter waiter)
+        {
+            std::shared_ptr<const Cached_file> response;
+            {
+                std::lock_guard<std::mutex> lock(pending->mtx);
+                if (!pending->done)
+                {
+                    pending->waiters.push_back(std::move(waiter));
+                    return;
+                }
+                response = pending->response;
+            }
+            waiter(std::move(response));
+        }
+
+        // Keeps the response of pending and hands it to every request waiting for it
+        // A null response is not kept, a stale one already there is served until it runs out
+        void fill(const Pending& pending, std::shared_ptr<const Cached_file> response, const Cache_policy& policy)
+        {
+            {
+                Shard& shard = shard_of(pending->key);
+                std::lock_guard<std::mutex> lock(shard.mtx);
+                auto it = shard.entries.find(pending->key);
+                if (it != shard.entries.end() && it->second.render == pending)
+                {
+                    Entry& entry = it->second;
+                    entry.render.reset();
+                    if (response)
+                    {
+                        entry.response = response;
+                        entry.fresh_until = std::chrono::steady_clock::now() + policy.ttl;
+                        entry.stale_until = entry.fresh_until + policy.stale;
+                    }
+                    else if (!entry.response)
+                    {
+                        shard.entries.erase(it);
+                        entries.fetch_sub(1, std::memory_order_relaxed);
+                    }
+                }
+            }
+
+            std::vector<Waiter> ready;
+            {
+                std::lock_guard<std::mutex> lock(pending->mtx);
+                pending->done = true;
+                pending->response = response;
+                ready.swap(pending->waiters);
+            }
+            for (Waiter& waiter : ready)
+            {
+                waiter(response);
+            }
+        }
+
+        Counters counters() const
+        {
+            Counters c;
+            c.hits = hits.load(std::memory_order_relaxed);
+            c.stale = stale_served.load(std::memory_order_relaxed);
+            c.misses = misses.load(std::memory_order_relaxed);
+            c.coalesced = coalesced_misses.load(std::memory_order_relaxed);
+            c.entries = entries.load(std::memory_order_relaxed);
+            return c;
+        }
+
+    private:
+        static const std::size_t shard_count = 16;
+
+        struct Entry {
+            std::shared_ptr<const Cached_file> response;
+            std::chrono::steady_clock::time_point fresh_until;
+            std::chrono::steady_clock::time_point stale_until;
+            // The render in flight for the key, if any
+            Pending render;
+        };
+
+        struct alignas(64) Shard {
+            std::mutex mtx;
+            std::unordered_map<std::string, Entry> entries;
+        };
+
+        Shard& shard_of(const std::string& key)
+        {
+            return shards[std::hash<std::string>()(key) % shard_count];
+        }
+
+        // A full shard first drops what has run out, then the entry that runs out soonest
+        // Entries with a render in flight are never dropped, the next request would start another
+        void make_room(Shard& shard, std::chrono::steady_clock::time_point now)
+        {
+            if (shard.entries.size() < shard_entries)
+            {
+                return;
+            }
+            auto soonest = shard.entries.end();
+            for (auto it = shard.entries.begin(); it != shard.entries.end();)
+            {
+                if (it->second.render)
+                {
+                    ++it;
+                    continue;
+                }
+                if (it->second.stale_until <= now)
+                {
+                    it = shard.entries.erase(it);
+                    entries.fetch_sub(1, std::memory_order_relaxed);
+                    continue;
+                }
+                if (soonest == shard.entries.end() || it->second.stale_until < soonest->second.stale_until)
+                {
+                    soonest = it;
+                }
+                ++it;
+            }
+            if (shard.entries.size() >= shard_entries && soonest != shard.entries.end())
+            {
+                shard.entries.erase(soonest);
+                entries.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+        const std::size_t shard_entries;
+        std::array<Shard, shard_count> shards;
+        std::atomic<std::uint64_t> hits { 0 };
+        std::atomic<std::uint64_t> stale_served { 0 };
+        std::atomic<std::uint64_t> misses { 0 };
+        std::atomic<std::uint64_t> coalesced_misses { 0 };
+        std::atomic<std::size_t> entries { 0 };
+};
+
+#endif  // _RESPONSECACHEHEAD_
@@ -0,0 +1,162 @@
+// Checks that requests waiting on a render of Response_cache get its response, even when the entry is
+// dropped to make room between the render being filled and the waiters asking for it
+// Build: g++ -std=c++17 -O2 response_cache_test.cpp -lboost_filesystem -lboost_system -lz -lpthread -o response_cache_test
+// Run:   ./response_cache_test, it prints every check that fails and exits with 1 if any did
+
+#include "response_cache.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+    if (!ok)
+    {
+        std::printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static std::shared_ptr<const Cached_file> response_of(const std::string& body)
+{
+    auto file = std::make_shared<Cached_file>();
+    file->body = body;
+    file->size = body.size();
+    return file;
+}
+
+// A cache of one entry, every other key that is filled pushes the last one out of its shard
+static void fill_others(Response_cache& cache, const Cache_policy& policy, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        std::shared_ptr<const Cached_file> cached;
+        Response_cache::Pending pending;
+        std::string key = "GET /other/" + std::to_string(i);
+        if (cache.lookup(key, cached, pending) == Response_cache::miss)
+        {
+            cache.fill(pending, response_of(key), policy);
+        }
+    }
+}
+
+// Two requests miss together, the render is filled and its entry dropped, and only then do both wait
+static void waiters_after_eviction()
+{
+    Response_cache cache(1);
+    Cache_policy policy;
+    policy.ttl = std::chrono::milliseconds(60000);
+
+    std::shared_ptr<const Cached_file> cached;
+    Response_cache::Pending first, second;
+    check(cache.lookup("GET /slow", cached, first) == Response_cache::miss, "first request misses");
+    check(cache.lookup("GET /slow", cached, second) == Response_cache::coalesced, "second request is coalesced");
+    check(first == second, "both requests wait on the same render");
+
+    auto rendered = response_of("rendered");
+    cache.fill(first, rendered, policy);
+    fill_others(cache, policy, 256);
+    check(cache.counters().entries <= 16, "the cache stays within its shards");
+
+    std::shared_ptr<const Cached_file> got[2];
+    std::thread waiters[2];
+    Response_cache::Pending pending[2] = { first, second };
+    for (int i = 0; i < 2; i++)
+    {
+        waiters[i] = std::thread([&got, &pending, i]()
+        {
+            Response_cache::wait(pending[i], [&got, i](std::shared_ptr<const Cached_file> response)
+            {
+                got[i] = response;
+            });
+        });
+    }
+    for (std::thread& waiter : waiters)
+    {
+        waiter.join();
+    }
+    check(got[0] == rendered && got[1] == rendered, "waiters after an eviction get the rendered response");
+}
+
+// Two requests wait from their own threads while the render is filled and the entry dropped
+static void waiters_during_fill()
+{
+    Response_cache cache(1);
+    Cache_policy policy;
+    policy.ttl = std::chrono::milliseconds(60000);
+
+    std::shared_ptr<const Cached_file> cached;
+    Response_cache::Pending first, second;
+    cache.lookup("GET /slow", cached, first);
+    cache.lookup("GET /slow", cached, second);
+
+    std::atomic<int> woken { 0 };
+    std::shared_ptr<const Cached_file> got[2];
+    std::thread waiters[2];
+    Response_cache::Pending pending[2] = { first, second };
+    for (int i = 0; i < 2; i++)
+    {
+        waiters[i] = std::thread([&got, &pending, &woken, i]()
+        {
+            Response_cache::wait(pending[i], [&got, &woken, i](std::shared_ptr<const Cached_file> response)
+            {
+                got[i] = response;
+                woken++;
+            });
+        });
+    }
+
+    auto rendered = response_of("rendered");
+    cache.fill(first, rendered, policy);
+    fill_others(cache, policy, 256);
+    for (std::thread& waiter : waiters)
+    {
+        waiter.join();
+    }
+    check(woken == 2, "every waiter is called once");
+    check(got[0] == rendered && got[1] == rendered, "waiters during the fill get the rendered response");
+}
+
+// A render that fails is not kept and its waiters get nothing
+static void failed_render()
+{
+    Response_cache cache(1);
+    Cache_policy policy;
+    policy.ttl = std::chrono::milliseconds(60000);
+
+    std::shared_ptr<const Cached_file> cached;
+    Response_cache::Pending first, second;
+    cache.lookup("GET /slow", cached, first);
+    cache.lookup("GET /slow", cached, second);
+
+    bool called = false;
+    std::shared_ptr<const Cached_file> got = response_of("unset");
+    Response_cache::wait(second, [&](std::shared_ptr<const Cached_file> response)
+    {
+        called = true;
+        got = response;
+    });
+    cache.fill(first, nullptr, policy);
+    check(called && !got, "a failed render wakes its waiters with no response");
+    check(cache.counters().entries == 0, "a failed render leaves no entry");
+    check(cache.lookup("GET /slow", cached, first) == Response_cache::miss, "the next request renders again");
+}
+
+int main()
+{
+    waiters_after_eviction();
+    waiters_during_fill();
+    failed_render();
+
+    if (failures == 0)
+    {
+        std::printf("all response cache checks passed\n");
+    }
+    return failures == 0 ? 0 : 1;
+}
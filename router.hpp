@@ -0,0 +1,282 @@
+#ifndef _ROUTERHEAD_
+#define _ROUTERHEAD_
+
+#include "file_cache.hpp"
+#include "http_parser.hpp"
+#include "response_cache.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Router {
+    // Maps request paths to what answers them, built once at startup and only read after that
+    // Routes are compiled into a radix tree keyed on the canonical path, a lookup walks it once from the
+    // root so it costs O(path length) and allocates nothing
+    // An exact route beats a directory route, and the longest directory that matches wins
+    // Registering the same path and kind again replaces the earlier route
+
+    public:
+        // Renders the response for a handler route on the connection's thread, so it must not block,
+        // a cached route's handler runs on the worker pool instead
+        // Returning null answers the request with 500
+        typedef std::function<std::shared_ptr<const Cached_file>(const Http_request& request)> Handler;
+
+        struct Route {
+            enum Kind { file, directory, handler };
+            Kind kind;
+            // Canonical request path, directories end in '/'
+            std::string pattern;
+            // File on disk for a file route, the directory the rest of the path is looked up in otherwise
+            std::string path;
+            Handler render;
+            Cache_policy cache;
+        };
+
+        struct Match {
+            const Route* route = nullptr;
+            // What is left of the path after a directory route's pattern
+            std::string_view rest;
+        };
+
+        // Answers exactly url with the file at path
+        bool add_file(std::string_view url, std::string path)
+        {
+            return add(Route::file, url, std::move(path), Handler());
+        }
+
+        // Answers every url under prefix with the file of the same name under root
+        bool add_directory(std::string_view prefix, std::string root)
+        {
+            if (!root.empty() && root.back() != '/')
+            {
+                root.push_back('/');
+            }
+            return add(Route::directory, prefix, std::move(root), Handler());
+        }
+
+        // Answers exactly url with whatever render returns, with a cache policy its GET responses are
+        // kept in the Response_cache
+        bool add_handler(std::string_view url, Handler render, Cache_policy cache = Cache_policy())
+        {
+            return add(Route::handler, url, std::string(), std::move(render), std::move(cache));
+        }
+
+        // File sent with 404 when a path has no route or its file does not exist
+        void not_found(std::string path)
+        {
+            not_found_path = std::move(path);
+        }
+
+        const std::string& not_found_page() const { return not_found_path; }
+
+        // Builds the tree from the routes added so far, must be done before the first match
+        void compile()
+        {
+            nodes.assign(1, Node());
+            for (std::size_t i = 0; i < routes.size(); i++)
+            {
+                insert(routes[i].pattern, routes[i].kind == Route::directory, i);
+            }
+        }
+
+        // path must already be canonical, see normalize()
+        Match match(std::string_view path) const
+        {
+            Match found;
+            std::uint32_t node = 0;
+            std::size_t pos = 0;
+            for (;;)
+            {
+                const Node& n = nodes[node];
+                if (n.prefix != none)
+                {
+                    found.route = &routes[n.prefix];
+                    found.rest = path.substr(pos);
+                }
+                if (pos == path.size())
+                {
+                    if (n.exact != none)
+                    {
+                        found.route = &routes[n.exact];
+                        found.rest = std::string_view();
+                    }
+                    return found;
+                }
+
+                const void* slot = std::memchr(n.first.data(), path[pos], n.first.size());
+                if (slot == nullptr)
+                {
+                    return found;
+                }
+                node = n.children[static_cast<const char*>(slot) - n.first.data()];
+                const std::string& label = nodes[node].label;
+                if (path.size() - pos < label.size() || path.compare(pos, label.size(), label) != 0)
+                {
+                    return found;
+                }
+                pos += label.size();
+            }
+        }
+
+        // Writes the canonical form of a request target to out: query and fragment dropped, %XX escapes
+        // decoded, repeated slashes merged and . and .. segments resolved without ever climbing above /
+        // out keeps its capacity from one request to the next, so after the first few requests this
+        // does not allocate
+        // Returns false for a target that is not a path or has a bad escape
+        static bool normalize(std::string_view target, std::string& out)
+        {
+            out.clear();
+            target = target.substr(0, target.find_first_of("?#"));
+            if (target.empty() || target[0] != '/')
+            {
+                return false;
+            }
+
+            out.push_back('/');
+            std::size_t segment = 1;
+            for (std::size_t i = 1; i <= target.size(); i++)
+            {
+                char c = '/';
+                if (i < target.size())
+                {
+                    c = target[i];
+                    if (c == '%')
+                    {
+                        int high = i + 2 < target.size() ? hex_value(target[i + 1]) : -1;
+                        int low = i + 2 < target.size() ? hex_value(target[i + 2]) : -1;
+                        if (high < 0 || low < 0 || (high == 0 && low == 0))
+                        {
+                            return false;
+                        }
+                        c = static_cast<char>(high * 16 + low);
+                        i += 2;
+                    }
+                    if (c != '/')
+                    {
+                        out.push_back(c);
+                        continue;
+                    }
+                }
+
+                //a segment has ended, the last one ends with the target and keeps no slash of its own
+                bool last = i == target.size();
+                std::string_view name(out.data() + segment, out.size() - segment);
+                if (name == "." || name == "..")
+                {
+                    out.resize(segment);
+                    if (name.size() == 2 && segment > 1)
+                    {
+                        out.resize(out.rfind('/', segment - 2) + 1);
+                    }
+                }
+                else if (!name.empty() && !last)
+                {
+                    out.push_back('/');
+                }
+                segment = out.size();
+            }
+            return true;
+        }
+
+    private:
+        static const std::uint32_t none = ~std::uint32_t(0);
+
+        struct Node {
+            // Bytes of the path this node adds to its parent's
+            std::string label;
+            // First byte of each child's label, searched with memchr, children[i] goes with first[i]
+            std::string first;
+            std::vector<std::uint32_t> children;
+            std::uint32_t exact = none;
+            std::uint32_t prefix = none;
+        };
+
+        bool add(Route::Kind kind, std::string_view url, std::string path, Handler render, Cache_policy cache = Cache_policy())
+        {
+            std::string pattern;
+            if (!normalize(url, pattern))
+            {
+                return false;
+            }
+            if (kind == Route::directory && pattern.back() != '/')
+            {
+                pattern.push_back('/');
+            }
+
+            for (Route& route : routes)
+            {
+                if (route.pattern == pattern && (route.kind == Route::directory) == (kind == Route::directory))
+                {
+                    route = Route{ kind, std::move(pattern), std::move(path), std::move(render), std::move(cache) };
+                    return true;
+                }
+            }
+            routes.push_back(Route{ kind, std::move(pattern), std::move(path), std::move(render), std::move(cache) });
+            return true;
+        }
+
+        void insert(const std::string& key, bool prefix, std::uint32_t route)
+        {
+            std::uint32_t node = 0;
+            std::size_t pos = 0;
+            while (pos < key.size())
+            {
+                std::size_t slot = nodes[node].first.find(key[pos]);
+                if (slot == std::string::npos)
+                {
+                    Node leaf;
+                    leaf.label = key.substr(pos);
+                    std::uint32_t child = nodes.size();
+                    nodes.push_back(std::move(leaf));
+                    nodes[node].first.push_back(key[pos]);
+                    nodes[node].children.push_back(child);
+                    node = child;
+                    break;
+                }
+
+                std::uint32_t child = nodes[node].children[slot];
+                const std::string& label = nodes[child].label;
+                std::size_t common = 0;
+                while (common < label.size() && pos + common < key.size() && label[common] == key[pos + common])
+                {
+                    common++;
+                }
+
+                //the key leaves the child's label part way, split the label where they part
+                if (common < label.size())
+                {
+                    Node middle;
+                    middle.label = label.substr(0, common);
+                    middle.first.push_back(label[common]);
+                    middle.children.push_back(child);
+                    nodes[child].label.erase(0, common);
+                    std::uint32_t split = nodes.size();
+                    nodes.push_back(std::move(middle));
+                    nodes[node].children[slot] = split;
+                    child = split;
+                }
+                node = child;
+                pos += common;
+            }
+            (prefix ? nodes[node].prefix : nodes[node].exact) = route;
+        }
+
+        static int hex_value(char c)
+        {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        }
+
+        std::vector<Route> routes;
+        std::vector<Node> nodes { Node() };
+        std::string not_found_path;
+};
+
+#endif  // _ROUTERHEAD_
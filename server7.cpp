@@ -1,23 +1,77 @@
-#include "server6.hpp"
+#include "server7.hpp"
+#include "coro_service.hpp"
+
+#include <sys/sendfile.h>
+
+// Waits for the head (request line and headers) of the next request
+// A new connection gets the header timeout, a kept-alive one the idle timeout unless part of the next head is already here
+void Service::client_handle()
+{
+    timing.mark(Request_timing::waiting);
+    arm_deadline(requests_served == 0 || request.size() > 0 ? options.header_timeout : options.keep_alive_timeout);
+    if (uring != nullptr)
+    {
+        read_head();
+        return;
+    }
+    asio::async_read_until(client_sock, request,"\r\n\r\n", bind_handler([this]( const boost::system::error_code& ec, size_t bytes)
+    {
+        wheel.cancel(deadline);
+        http_request(ec, bytes);
+    }));
+}
+
+// io_uring has no read_until, the buffer is searched for the end of the head after every receive
+void Service::read_head()
+{
+    auto data = request.data();
+    std::string_view buffered(static_cast<const char*>(data.data()), data.size());
+    std::size_t end = buffered.find("\r\n\r\n");
+    if (end != std::string_view::npos || request.size() >= request.max_size())
+    {
+        wheel.cancel(deadline);
+        http_request(end != std::string_view::npos ? boost::system::error_code() : asio::error::not_found,
+            end != std::string_view::npos ? end + 4 : 0);
+        return;
+    }
+
+    read_some(request.prepare(request.max_size() - request.size()), [this](const boost::system::error_code& ec, std::size_t bytes)
+    {
+        if (ec)
+        {
+            wheel.cancel(deadline);
+            http_request(ec, 0);
+            return;
+        }
+        request.commit(bytes);
+        read_head();
+    });
+}
 
 // This functions handles the http requests from the client (url)
 void Service::http_request(const boost::system::error_code& ec, size_t bytes)
 {
-    //Points the logger to correct pointer
-    std::shared_ptr<spdlog::logger> loggers;
+    if (ec == asio::error::eof || ec == asio::error::operation_aborted)
+    {
+        // Client closed a kept-alive connection or it sat idle for too long
+        cleanup();
+        return;
+    }
+
+    request_start = std::chrono::steady_clock::now();
+    timing.mark(Request_timing::head);
+    metrics.received(bytes);
 
     if (ec) 
     {
-        //Logger is accessed to output if there is an error 'critical' 
-        loggers = spdlog::get("Server");
         // Outputs the logs with correct critical message
-        loggers->critical("Error Code: ", ec.value(), "Message: ", ec.message());
+        server_log().critical("Error Code: {} Message: {}", ec.value(), ec.message());
 
         if (ec == asio::error::not_found) 
         {
             //Logs critical code 413 Request is too large
              status_code = 413;
-             loggers->warn("Error Code: 413");
+             server_log().warn("Error Code: 413");
              server_response_handle();
              return;
         }
@@ -29,250 +83,1213 @@ void Service::http_request(const boost::system::error_code& ec, size_t bytes)
         }
     }
 
-    // This is to parse the request line 'r_line' from the clients input
-    std::string r_line;
-    std::istream r_stream(&request);
-    std::getline(r_stream, r_line, '\r');
-    // Removes symbol '\n' from the buffer to be parsed.
-    r_stream.get();
-    // Parse the request line to get the http method (POST) (GET).
-    std::string r_method; 
-    std::istringstream r_line_stream(r_line);
-    r_line_stream >> r_method;
-    
+    // Parse the request line and headers in place, the views stay valid until the request is consumed
+    auto data = request.data();
+    Http_parser::Result result = parser.parse(static_cast<const char*>(data.data()), data.size(), request_header);
+
+    if (result != Http_parser::complete) 
+    {
+        status_code = result == Http_parser::too_many_headers ? 431 : 400;
+        server_log().warn("Malformed request: Error {}", status_code);
+        server_response_handle();
+        return;
+    }
 
     //Only allows the GET method or the POST method any other method the server disconnects the client
-    if (r_method.compare("GET") != 0 && r_method.compare("POST") != 0)  
+    if (request_header.method != "GET" && request_header.method != "POST")  
     {
         status_code = 501;
-        loggers = spdlog::get("Server");
-        loggers->critical("Unsupported Method: Error 501");
+        server_log().critical("Unsupported Method: Error 501");
         server_response_handle();
         return;
     }
 
-    
-    //Passes the line stream to the URL
-    r_line_stream >> url;
-    
+    url.assign(request_header.target.data(), request_header.target.size());
 
-    if(r_method.compare("POST") == 0)
+    if(request_header.method == "POST")
     { 
-        loggers = spdlog::get("Client");
-        loggers->info("POST Data sent by client");
+        client_log().info("POST Data sent by client");
     }
 
-    //Next is to parse the http version
-    string request_http_version;
-    r_line_stream >> request_http_version;
-
-    if (request_http_version.compare("HTTP/1.1") != 0) 
+    if (request_header.version != "HTTP/1.1") 
     {
             status_code = 505;
-            loggers->critical("Unsupported HTTP Version: Error 505");
+            server_log().critical("Unsupported HTTP Version: Error 505");
             server_response_handle();
             return;
     }
 
-    // Once the request has been parsed sucesfully the request header (http) is read
-    asio::async_read_until(*client_sock.get(),request,"\r\n\r\n", [this]( const boost::system::error_code& ec, size_t bytes)
+    timing.mark(Request_timing::parsed);
+
+    //a request with a body is only answered once all of the body has been read
+    if (!start_body())
     {
-        http_request_header(ec, bytes);
-    });
+        return;
+    }
+    if (head_consumed)
+    {
+        //clients that wait to be told before sending the body are told straight away, and responses
+        //held for earlier pipelined requests go out first rather than wait for the whole body
+        bool expect_continue = header_iequals(request_header.header("Expect"), "100-continue");
+        if (expect_continue || !held.empty())
+        {
+            static constexpr std::string_view continue_line = "HTTP/1.1 100 Continue\r\n\r\n";
+            if (expect_continue)
+            {
+                gather(std::array<asio::const_buffer, 1>{ asio::buffer(continue_line) });
+            }
+            write_gathered([this](const boost::system::error_code& ec, std::size_t)
+            {
+                held_sent();
+                if (ec)
+                {
+                    cleanup();
+                    return;
+                }
+                read_body();
+            });
+            return;
+        }
+        read_body();
+        return;
+    }
 
+    http_request_header();
     return;
 }
 
-//This function reads the request header
-void Service::http_request_header(const boost::system::error_code& ec,std::size_t bytes)
+// Works out how the body is framed and gets the receive buffer ready for it
+// Returns false if the request was answered with an error instead, the connection is closed after that
+// since the rest of the body is still on the wire
+bool Service::start_body()
 {
-    if (ec) 
+    Body_decoder::Framing framing = body.start(request_header, options.max_body_bytes);
+    if (framing == Body_decoder::no_body)
     {
-        std::shared_ptr<spdlog::logger> loggers;
-        loggers = spdlog::get("Server");
-        loggers->critical("Error Code: ", ec.value(), "Message: ", ec.message());
-        if (ec == asio::error::not_found) 
+        return true;
+    }
+
+    if (framing != Body_decoder::framed)
+    {
+        status_code = framing == Body_decoder::unsupported_coding ? 501 : framing == Body_decoder::framed_too_large ? 413 : 400;
+        server_log().warn("Unsupported body framing: Error {}", status_code);
+        server_response_handle();
+        return false;
+    }
+
+    //the head moves out of the receive buffer, so the buffer can take the body a piece at a time
+    if (head_copy == nullptr)
+    {
+        head_copy = static_cast<char*>(Block_pool<Buffer_allocator<char>::block_size>::allocate());
+    }
+    std::size_t head_length = request_header.length;
+    std::memcpy(head_copy, request.data().data(), head_length);
+    parser.reset();
+    parser.parse(head_copy, head_length, request_header);
+    request.consume(head_length);
+    head_consumed = true;
+    return true;
+}
+
+// Hands the body to the body sink one piece at a time
+// More is read from the socket only after the sink is done with what is buffered, so the receive
+// buffer is all the memory an upload ever takes, however big it is
+void Service::read_body()
+{
+    auto data = request.data();
+    std::size_t consumed = 0;
+    std::string_view piece;
+    Body_decoder::Result result = body.next(static_cast<const char*>(data.data()), data.size(), consumed, piece);
+
+    if (result == Body_decoder::bad_body || result == Body_decoder::too_large)
+    {
+        status_code = result == Body_decoder::too_large ? 413 : 400;
+        server_log().warn("Bad request body: Error {}", status_code);
+        server_response_handle();
+        return;
+    }
+
+    if (result == Body_decoder::need_more)
+    {
+        request.consume(consumed);
+        if (request.size() >= request.max_size())
         {
-            loggers->warn("Error Code: 413");
-            status_code = 413; 
+            //a chunk size line longer than the whole buffer
+            status_code = 400;
             server_response_handle();
             return;
         }
-        else 
+
+        arm_deadline(options.body_timeout);
+        read_some(request.prepare(request.max_size() - request.size()), [this](const boost::system::error_code& ec, std::size_t bytes)
         {
-            //socket clean up
-            cleanup();
-            return;
-        }
+            wheel.cancel(deadline);
+            if (ec)
+            {
+                cleanup();
+                return;
+            }
+            request.commit(bytes);
+            metrics.received(bytes);
+            read_body();
+        });
+        return;
     }
-    // Parse and store headers in appropriate values.
-    std::istream r_stream(&request);
-
-    std::string h_value, h_name;
 
-    while (!r_stream.eof()) 
+    //the piece stays in the receive buffer until the sink is done with it
+    bool last = result == Body_decoder::done;
+    Body_sink& sink = body_sink;
+    std::string_view target = url;
+    arm_deadline(options.handler_timeout);
+    workers.submit([&sink, target, piece, last]()
+    {
+        sink.consume(target, piece.data(), piece.size(), last);
+        return true;
+    },
+    bind_handler([this, consumed, last](const boost::system::error_code& ec, bool)
     {
-        std::getline(r_stream, h_name, ':');
-        if (!r_stream.eof()) 
+        wheel.cancel(deadline);
+        if (ec)
         {
-            std::getline(r_stream, h_value, '\r');
-            // Remove symbol \n from the stream to pass through to request header.
-            r_stream.get();
-            request_header[h_name] = h_value;
+            server_log().warn("Worker queue full: Error 503 ");
+            status_code = 503;
+            server_response_handle();
+            return;
         }
-    }
-    // Handle clients request
+        request.consume(consumed);
+        if (last)
+        {
+            http_request_header();
+            return;
+        }
+        read_body();
+    }));
+}
+
+//This function acts on the parsed request headers
+void Service::http_request_header()
+{
+    timing.mark(Request_timing::body);
+
+    // HTTP/1.1 connections stay open unless the client asks otherwise, has used up its requests or the server is draining
+    ++requests_served;
+    keep_alive = requests_served < options.max_keep_alive_requests
+        && !header_iequals(request_header.header("Connection"), "close") && !draining;
+
+    // Handle clients request, which sends the response once the resource has been found
     http_request_handle();
-    // Handle the servers response 
-    server_response_handle();
     return;
 }
 
 void Service::http_request_handle() 
 {
-    std::shared_ptr<spdlog::logger> loggers;
+    //the target is made canonical once, everything after works on r_route
+    if (!Router::normalize(url, r_route))
+    {
+        server_log().warn("Malformed request target: Error 400");
+        status_code = 400;
+        server_response_handle();
+        return;
+    }
 
-    //checks for // input and parses it then passes the client to the home page
-    if(url.compare("/") == 0 && url.compare("//"))
+    //a path no route takes is looked up as an empty path, which always ends in the error page
+    Router::Match match = router.match(r_route);
+    const std::string* file_path = &r_path;
+    r_path.clear();
+    if (match.route && match.route->kind == Router::Route::handler)
     {
-        url = std::string("home.html");
-        loggers = spdlog::get("Client");
-        loggers->info("Client Accessed: Webpage ");
+        if (match.route->cache.ttl.count() > 0 && request_header.method == "GET")
+        {
+            cached_render(*match.route);
+            return;
+        }
+        resource_found(Resource_lookup{ match.route->render(request_header), 200 });
+        return;
+    }
+    if (match.route && match.route->kind == Router::Route::file)
+    {
+        file_path = &match.route->path;
+    }
+    else if (match.route)
+    {
+        r_path.assign(match.route->path).append(match.rest);
     }
 
-    if(url.compare("///") == 0 && url.compare("////"))
+    //files already in the shared cache are answered straight away
+    std::shared_ptr<const Cached_file> cached = file_path->empty() ? nullptr : files.find(*file_path);
+    if (cached) 
     {
-        url = std::string("home.html");
-        loggers = spdlog::get("Client");
-        loggers->info("Client Accessed: Webpage ");
+        resource_found(Resource_lookup{ cached, 200 });
+        return;
     }
 
-    //sets the file path to find the correlating 
-    std::string file_path = std::string("/home/cyber/http/") + url;
+    //a miss has to read the disk, that is done on the worker pool so this thread keeps serving other connections
+    File_cache& cache = files;
+    const Router& routes = router;
+    arm_deadline(options.handler_timeout);
+    workers.submit([&cache, &routes, path = *file_path]() 
+    {
+        return lookup_resource(cache, path, routes.not_found_page());
+    }, 
+    bind_handler([this](const boost::system::error_code& ec, Resource_lookup lookup)
+    {
+        wheel.cancel(deadline);
+        if (ec) 
+        {
+            //the worker queue is full, turn the request away rather than queue it
+            server_log().warn("Worker queue full: Error 503 ");
+            status_code = 503;
+            server_response_handle();
+            return;
+        }
+        resource_found(lookup);
+    }));
+}
 
+// Answers a GET on a cached handler route from the response cache
+// A miss renders on the worker pool, and requests for the same key that come in meanwhile wait for
+// that render instead of starting their own
+void Service::cached_render(const Router::Route& route)
+{
+    Response_cache::make_key(request_header, route.cache, r_cache_key);
+    std::shared_ptr<const Cached_file> cached;
+    Response_cache::Pending pending;
+    Response_cache::Outcome outcome = responses.lookup(r_cache_key, cached, pending);
+    if (outcome == Response_cache::miss || outcome == Response_cache::refresh)
+    {
+        render_into_cache(workers, responses, route, request_header, pending, strand.get_inner_executor());
+    }
+    if (outcome != Response_cache::miss && outcome != Response_cache::coalesced)
+    {
+        resource_found(Resource_lookup{ cached, 200 });
+        return;
+    }
 
-    //if the file is not found it returns error 404 with the appropriate page
-    if (!boost::filesystem::exists(file_path)) 
+    //the render finishes on whichever thread ran it, the response is taken back to the connection's strand
+    arm_deadline(options.handler_timeout);
+    auto rendered = bind_handler([this](std::shared_ptr<const Cached_file> response)
     {
-        status_code = 404;
-        loggers = spdlog::get("Client");
-        loggers->warn("Page not found: Error 404 ");
-        url = std::string("error.html");
-        
+        wheel.cancel(deadline);
+        resource_found(Resource_lookup{ response, 200 });
+    });
+    Response_cache::wait(pending, [rendered](std::shared_ptr<const Cached_file> response)
+    {
+        asio::post(rendered.get_executor(), [rendered, response]() mutable
+        {
+            rendered(response);
+        });
+    });
+}
+
+void render_into_cache(Worker_pool& workers, Response_cache& cache, const Router::Route& route, const Http_request& request,
+                       const Response_cache::Pending& pending, asio::any_io_executor executor)
+{
+    struct Render {
+        std::string head;
+        Http_request request;
+        Response_cache::Pending pending;
+    };
+    auto render = std::make_shared<Render>();
+    render->head.assign(request.method.data(), request.length);
+    Http_parser parser;
+    parser.parse(render->head.data(), render->head.size(), render->request);
+    render->pending = pending;
+
+    const Router::Route* cached_route = &route;
+    workers.submit([render, cached_route]()
+    {
+        return cached_route->render(render->request);
+    },
+    asio::bind_executor(executor, [render, cached_route, &cache](const boost::system::error_code& ec, std::shared_ptr<const Cached_file> response)
+    {
+        //a full worker queue fails the render like a handler returning null, the waiters get a 500
+        cache.fill(render->pending, ec ? nullptr : std::move(response), cached_route->cache);
+    }));
+}
+
+//Reads the file at file_path through the cache, falling back to the error page, runs on a worker thread
+Service::Resource_lookup Service::lookup_resource(File_cache& cache, const std::string& file_path, const std::string& not_found_path)
+{
+    std::shared_ptr<const Cached_file> file = file_path.empty() ? nullptr : cache.get(file_path);
+    if (file) 
+    {
+        return Resource_lookup{ file, 200 };
     }
+    return Resource_lookup{ cache.get(not_found_path), 404 };
+}
 
+//Sets up the response for the file that was looked up and sends it
+void Service::resource_found(const Resource_lookup& lookup)
+{
+    timing.mark(Request_timing::resolved);
+    r_file = lookup.file;
+    status_code = lookup.status;
 
-    file_path = std::string("/home/cyber/http/") + url;
+    //if the file is not found it returns error 404 with the appropriate page
+    if (status_code == 404) 
+    {
+        client_log().warn("Page not found: Error 404 ");
+        url = std::string("error.html");
+    }
 
-    std::ifstream r_fstream(file_path,std::ifstream::binary);
-    if (!r_fstream.is_open()) 
+    if (!r_file) 
     {
         //If file can not open send out appropriate message along side log
-        loggers = spdlog::get("Client");
-        loggers->warn("Could not open file: Error 500 ");
+        client_log().warn("Could not open file: Error 500 ");
         status_code = 500;
+        server_response_handle();
         return;
     }
 
-    // Find out file size to pass into the http header "content length".
-    r_fstream.seekg(0, std::ifstream::end);
-    resource_size = static_cast<size_t>(r_fstream.tellg());
-    r_buffer.reset(new char[resource_size]);
+    //a compressed copy is sent exactly like the file, with its own headers, validators and length
+    if (status_code == 200)
+    {
+        r_file = negotiate_coding(request_header, r_file, options, files, workers);
+    }
+
+    //a client that already has this version of the file is told so instead of being sent it again
+    if (status_code == 200 && request_header.method == "GET" && not_modified(request_header, *r_file))
+    {
+        status_code = 304;
+        server_response_handle();
+        return;
+    }
+
+    //a GET for part of the file is answered with only those bytes, as long as If-Range still matches
+    if (status_code == 200 && request_header.method == "GET" && range_applies(request_header, *r_file))
+    {
+        std::string_view range = request_header.header("Range");
+        Byte_ranges::Result ranges = range.empty() ? Byte_ranges::none : r_ranges.parse(range, r_file->size);
+        if (ranges == Byte_ranges::unsatisfiable)
+        {
+            status_code = 416;
+            server_response_handle();
+            return;
+        }
+        if (ranges == Byte_ranges::satisfiable)
+        {
+            status_code = 206;
+        }
+    }
+
+    //large files are opened here and sent straight from the page cache once the header is out
+    if (r_file->streamed) 
+    {
+        r_fd = ::open(r_file->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (r_fd < 0) 
+        {
+            client_log().warn("Could not open file: Error 500 ");
+            status_code = 500;
+            r_file.reset();
+            server_response_handle();
+            return;
+        }
+    }
+
+    if (status_code == 206 && r_ranges.count > 1)
+    {
+        prepare_multipart();
+    }
+    else
+    {
+        std::uint64_t first = status_code == 206 ? r_ranges.ranges[0].first : 0;
+        std::uint64_t last = status_code == 206 ? r_ranges.ranges[0].last : r_file->size - 1;
+        std::uint64_t length = r_file->size == 0 ? 0 : last - first + 1;
+        if (r_file->streamed)
+        {
+            r_offset = first;
+            r_remaining = length;
+        }
+        else
+        {
+            r_body = std::string_view(r_file->body).substr(first, length);
+        }
+    }
+
+    server_response_handle();
+}
+
+// Picks the most preferred compressed copy the client accepts, or the file itself
+// A text file without a gzip copy gets one built on the worker pool for the requests after this one
+std::shared_ptr<const Cached_file> negotiate_coding(const Http_request& request, const std::shared_ptr<const Cached_file>& file,
+                                                   const Server_options& options, File_cache& files, Worker_pool& workers)
+{
+    std::string_view accept = request.header("Accept-Encoding");
+    if (accept.empty())
+    {
+        return file;
+    }
+
+    for (int coding = 0; coding < content_codings; coding++)
+    {
+        std::shared_ptr<const Cached_file> variant = std::atomic_load(&file->variants[coding]);
+        if (variant && coding_accepted(accept, content_coding_names_g[coding]))
+        {
+            return variant;
+        }
+    }
 
-    // passes into the buffer 
-    r_fstream.seekg(std::ifstream::beg);
-    r_fstream.read(r_buffer.get(),resource_size);
-    r_header += string("content-length") + ": " + to_string(resource_size) + "\r\n";
+    if (options.background_compression && file->compressible && !file->streamed && coding_accepted(accept, "gzip")
+        && !file->compress_requested.exchange(true))
+    {
+        File_cache& cache = files;
+        std::shared_ptr<const Cached_file> base = file;
+        if (!workers.post([&cache, base]()
+            {
+                std::shared_ptr<const Cached_file> variant = File_cache::gzip(*base);
+                if (variant)
+                {
+                    cache.add_variant(base, coding_gzip, variant);
+                }
+            }))
+        {
+            file->compress_requested = false;
+        }
+    }
+    return file;
+}
+
+// If-None-Match is checked against the file's etag, and only when it is absent If-Modified-Since against its mtime
+bool not_modified(const Http_request& request, const Cached_file& file)
+{
+    if (file.etag.empty())
+    {
+        return false;
+    }
+
+    std::string_view none_match = request.header("If-None-Match");
+    if (!none_match.empty())
+    {
+        return etag_matches(none_match, file.etag);
+    }
+
+    std::time_t since;
+    std::string_view modified_since = request.header("If-Modified-Since");
+    return !modified_since.empty() && parse_http_date(modified_since, since) && file.mtime <= since;
+}
+
+// A Range with If-Range is only used when the validator still names this version of the file,
+// otherwise the client's partial copy is stale and it gets the whole file
+bool range_applies(const Http_request& request, const Cached_file& file)
+{
+    std::string_view if_range = request.header("If-Range");
+    if (if_range.empty())
+    {
+        return true;
+    }
+    if (if_range.front() == '"')
+    {
+        return if_range == file.etag;
+    }
+    std::time_t date;
+    return parse_http_date(if_range, date) && date == file.mtime;
+}
+
+// Lays out a multipart/byteranges body, the part headers are rendered into r_multipart and
+// the bytes of each range are sent after its header straight from the cached body or the file
+void Service::prepare_multipart()
+{
+    std::string total = std::to_string(r_file->size);
+    r_content_length = 0;
+
+    for (std::size_t i = 0; i <= r_ranges.count; i++)
+    {
+        Body_part part{ r_multipart.size(), 0, 0, 0 };
+        r_multipart.append("\r\n--").append(multipart_boundary_g);
+        if (i < r_ranges.count)
+        {
+            const Byte_range& range = r_ranges.ranges[i];
+            r_multipart.append("\r\ncontent-range: bytes ").append(std::to_string(range.first)).append("-")
+                .append(std::to_string(range.last)).append("/").append(total).append("\r\n\r\n");
+            part.file_offset = range.first;
+            part.file_size = range.last - range.first + 1;
+        }
+        else
+        {
+            // The closing delimiter has no bytes after it
+            r_multipart.append("--\r\n");
+        }
+        part.text_size = r_multipart.size() - part.text_offset;
+        r_content_length += part.text_size + part.file_size;
+        r_parts.push_back(part);
+    }
 }
 
 
 // Handles server response 
 void Service::server_response_handle() 
 {
-    //Closes the socket
-    client_sock->shutdown(asio::ip::tcp::socket::shutdown_receive);
+    timing.mark(Request_timing::writing);
+
+    //The response is gathered from the static status line, the headers rendered with the file
+    //and the per response lines, none of which allocate
+    std::array<asio::const_buffer, 5> response_buffers;
+    response_buffers[0] = asio::buffer(http_status_line(status_code));
+    char range[64];
+
+    if (!r_file || status_code == 416) 
+    {
+        if (r_file)
+        {
+            int n = std::snprintf(range, sizeof(range), "bytes */%llu", static_cast<unsigned long long>(r_file->size));
+            r_header.add("content-range", std::string_view(range, n));
+        }
+        r_header.add("content-length", 0);
+    }
+    else if (status_code == 304)
+    {
+        //no body and no length, only the validators and the other headers of the file
+        response_buffers[1] = asio::buffer(r_file->headers);
+    }
+    else if (status_code == 206 && r_parts.empty())
+    {
+        const Byte_range& only = r_ranges.ranges[0];
+        int n = std::snprintf(range, sizeof(range), "bytes %llu-%llu/%llu", static_cast<unsigned long long>(only.first),
+            static_cast<unsigned long long>(only.last), static_cast<unsigned long long>(r_file->size));
+        response_buffers[1] = asio::buffer(r_file->headers);
+        r_header.add("content-range", std::string_view(range, n));
+        r_header.add("content-length", only.last - only.first + 1);
+    }
+    else if (status_code == 206)
+    {
+        response_buffers[1] = asio::buffer(r_file->headers);
+        r_header.add("content-type", multipart_content_type_g);
+        r_header.add("content-length", r_content_length);
+    }
+    else 
+    {
+        response_buffers[1] = asio::buffer(r_file->headers);
+        response_buffers[2] = asio::buffer(r_file->length_header);
+    }
 
-    //Creates the http header with the status line and content length 
-    auto status_line = http_table_g.at(status_code);
-    status_line = std::string("HTTP/1.1 ") + status_line + "\r\n";
-    r_header += "\r\n";
-    std::vector<asio::const_buffer> response_buffers;
-    response_buffers.push_back (asio::buffer(status_line));
+    if (keep_alive) 
+    {
+        r_header.add("connection", "keep-alive");
+    }
+    else 
+    {
+        r_header.add("connection", "close");
+    }
+    r_header.append("\r\n");
+    response_buffers[3] = asio::buffer(r_header.view());
+    response_buffers[4] = asio::buffer(r_body);
 
-    if (r_header.length() > 0) 
+    //header lines that did not fit are never sent cut short, the response becomes a bare 500 instead
+    if (r_header.overflowed())
     {
-        response_buffers.push_back(asio::buffer(r_header));
+        server_log().error("Response headers for {} did not fit, sending 500", url);
+        status_code = 500;
+        keep_alive = false;
+        r_remaining = 0;
+        r_parts.clear();
+        response_buffers.fill(asio::const_buffer());
+        response_buffers[0] = asio::buffer(http_status_line(status_code));
+        response_buffers[3] = asio::buffer(overflow_headers_g);
     }
-    if (resource_size > 0) 
+
+    //a small response to a pipelined request waits for the responses after it, so they share one write
+    if (hold_response(response_buffers))
     {
-        response_buffers.push_back(asio::buffer(r_buffer.get(), resource_size));
+        return;
     }
             
     // Initiate asynchronous write operation to the client with the buffer and http header.
-    asio::async_write(*client_sock.get(), response_buffers, [this] (const boost::system::error_code& ec, std::size_t bytes)
+    // Any responses held for earlier pipelined requests go out ahead of it in the same write
+    std::size_t earlier = held_bytes;
+    gather(response_buffers);
+    write_gathered([this, earlier] (const boost::system::error_code& ec, std::size_t bytes)
     {
-        response_sent(ec, bytes);
+        held_sent();
+        r_bytes_sent = bytes > earlier ? bytes - earlier : 0;
+        if (ec) 
+        {
+            response_sent(ec);
+            return;
+        }
+        if (r_remaining > 0) 
+        {
+            send_file();
+            return;
+        }
+        send_part();
+    });
+}
+
+// Keeps a response back when the next pipelined request is already buffered, instead of writing it now
+// Only responses held entirely in memory wait, a streamed file or multipart body is written in its turn
+// and takes the held responses with it
+bool Service::hold_response(const std::array<asio::const_buffer, 5>& buffers)
+{
+    if (!keep_alive || r_fd >= 0 || !r_parts.empty() || held.size() + 1 >= pipeline_depth || !request_buffered())
+    {
+        return false;
+    }
+
+    if (held.capacity() == 0)
+    {
+        held.reserve(pipeline_depth - 1);
+    }
+    held.emplace_back();
+    Held_response& response = held.back();
+    response.lines = r_header;
+    response.start = request_start;
+    response.timing = timing;
+    response.status = status_code;
+    response.method = method_of(request_header.method);
+
+    //the per response lines are written from the held copy, everything else already outlives the request
+    std::array<asio::const_buffer, 5> kept = buffers;
+    kept[3] = asio::buffer(response.lines.view());
+    response.bytes = gather(kept);
+    response.file = std::move(r_file);
+    held_bytes += response.bytes;
+
+    reset_request();
+    client_handle();
+    return true;
+}
+
+// True if the head of another request follows the current one in the receive buffer
+bool Service::request_buffered() const
+{
+    auto data = request.data();
+    std::string_view rest(static_cast<const char*>(data.data()), data.size());
+    if (!head_consumed)
+    {
+        rest.remove_prefix(std::min(rest.size(), request_header.length));
+    }
+    return rest.find("\r\n\r\n") != std::string_view::npos;
+}
+
+// Called once a gathered write is done, the responses that were held in it are counted and logged
+void Service::held_sent()
+{
+    for (Held_response& response : held)
+    {
+        record_response(response.status, response.bytes, response.start, response.file ? response.file->path_id : 0, response.method, response.timing);
+    }
+    held.clear();
+    held_bytes = 0;
+}
+
+// Sends the body of a streamed file with sendfile, waiting for the socket to drain whenever it is full
+// so the thread goes back to the io_context instead of blocking
+void Service::send_file()
+{
+    client_sock.native_non_blocking(true);
+
+    while (r_remaining > 0) 
+    {
+        ssize_t sent = ::sendfile(client_sock.native_handle(), r_fd, &r_offset, r_remaining);
+        if (sent > 0) 
+        {
+            r_remaining -= sent;
+            r_bytes_sent += sent;
+            continue;
+        }
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) 
+        {
+            // The write timeout starts over whenever the client has taken more of the file
+            arm_deadline(options.write_timeout);
+            client_sock.async_wait(asio::ip::tcp::socket::wait_write, bind_handler([this] (const boost::system::error_code& ec)
+            {
+                if (ec) 
+                {
+                    response_sent(ec);
+                    return;
+                }
+                send_file();
+            }));
+            return;
+        }
+
+        // The file shrank or the socket failed, the client can not get the length it was promised
+        keep_alive = false;
+        response_sent(sent == 0 ? boost::system::error_code(asio::error::eof) : boost::system::error_code(errno, boost::system::system_category()));
+        return;
+    }
+
+    send_part();
+}
+
+// Sends the next part of a multipart body, its header and then its bytes, and the response is done after the last one
+void Service::send_part()
+{
+    if (r_part == r_parts.size())
+    {
+        response_sent(boost::system::error_code());
+        return;
+    }
+
+    const Body_part& part = r_parts[r_part++];
+    std::array<asio::const_buffer, 2> buffers;
+    buffers[0] = asio::buffer(r_multipart.data() + part.text_offset, part.text_size);
+    if (r_fd >= 0)
+    {
+        r_offset = part.file_offset;
+        r_remaining = part.file_size;
+    }
+    else
+    {
+        buffers[1] = asio::buffer(r_file->body.data() + part.file_offset, part.file_size);
+    }
+
+    gather(buffers);
+    write_gathered([this] (const boost::system::error_code& ec, std::size_t bytes)
+    {
+        r_bytes_sent += bytes;
+        if (ec) 
+        {
+            response_sent(ec);
+            return;
+        }
+        if (r_remaining > 0) 
+        {
+            send_file();
+            return;
+        }
+        send_part();
     });
 }
 
 //Call back to check any errors before closing up the sockets and running cleanup
-void Service::response_sent(const boost::system::error_code& ec, std::size_t bytes) 
+void Service::response_sent(const boost::system::error_code& ec) 
 {
+    wheel.cancel(deadline);
+    record_response();
+
     if (ec) 
     {
-        std::shared_ptr<spdlog::logger> loggers;
-        loggers = spdlog::get("Server");
-        loggers->critical("Error Code: ", ec.value(), "Message: ", ec.message());
+        server_log().critical("Error Code: {} Message: {}", ec.value(), ec.message());
+        cleanup();
+        return;
+    }
+
+    if (!keep_alive)
+    {
+        //the peer may have reset the connection already, that is no reason to stop the server
+        boost::system::error_code ignored;
+        client_sock.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+        cleanup();
+        return;
+    }
+
+    // Keep the socket and wait for the next request on it
+    reset_request();
+    client_handle();
+}
+
+// Counts the finished response in the metrics and hands a record of it to the access log,
+// nothing here allocates or blocks unless the log was set to wait for room
+void Service::record_response()
+{
+    record_response(status_code, r_bytes_sent, request_start, r_file ? r_file->path_id : 0, method_of(request_header.method), timing);
+}
+
+void Service::record_response(unsigned int status, std::uint64_t bytes, std::chrono::steady_clock::time_point start, std::uint32_t path_id, Access_record::Method method,
+                              Request_timing& timing)
+{
+    std::uint64_t latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    metrics.responded(http_status_index(status), bytes, latency_ns);
+    timing.mark(Request_timing::sent);
+    stages.record(timing, client_sock.native_handle(), status);
+
+    if (!access_log.enabled())
+    {
+        return;
+    }
+
+    if (peer_port == 0)
+    {
+        boost::system::error_code ignored;
+        asio::ip::tcp::endpoint peer = client_sock.remote_endpoint(ignored);
+        if (peer.address().is_v4())
+        {
+            peer_address = peer.address().to_v4().to_uint();
+        }
+        peer_port = peer.port();
+    }
+
+    Access_record record;
+    record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    record.bytes = bytes;
+    record.peer_address = peer_address;
+    record.path_id = path_id;
+    record.latency_us = latency_ns / 1000;
+    record.peer_port = peer_port;
+    record.status = status;
+    record.method = method;
+    access_log.record(record);
+}
+
+Access_record::Method Service::method_of(std::string_view method)
+{
+    return method == "GET" ? Access_record::get : method == "POST" ? Access_record::post : Access_record::other;
+}
+
+// Writes the samples of one Prometheus histogram, the fine latency buckets folded into a fixed set of
+// bounds in seconds, labels go in every sample ahead of le
+static void append_duration_histogram(std::string& text, const char* name, const char* labels, const std::uint64_t* buckets,
+                                      std::uint64_t count, std::uint64_t sum_ns)
+{
+    static const double bounds[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+    const char* comma = labels[0] != '\0' ? "," : "";
+    std::size_t bucket = 0;
+    std::uint64_t cumulative = 0;
+    char line[160];
+    for (double bound : bounds)
+    {
+        while (bucket < Latency_histogram::bucket_count && Latency_histogram::upper_bound_of(bucket) <= bound * 1e9)
+        {
+            cumulative += buckets[bucket++];
+        }
+        std::snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, comma, bound, static_cast<unsigned long long>(cumulative));
+        text.append(line);
     }
-    client_sock->shutdown(asio::ip::tcp::socket::shutdown_both);
-    cleanup () ;   
+    std::snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, comma, static_cast<unsigned long long>(count));
+    text.append(line);
+    const char* open = labels[0] != '\0' ? "{" : "";
+    const char* close = labels[0] != '\0' ? "}" : "";
+    std::snprintf(line, sizeof(line), "%s_sum%s%s%s %.9f\n", name, open, labels, close, sum_ns / 1e9);
+    text.append(line);
+    std::snprintf(line, sizeof(line), "%s_count%s%s%s %llu\n", name, open, labels, close, static_cast<unsigned long long>(count));
+    text.append(line);
 }
-//closes and deletes the instance of service object called
+
+// Renders the metrics in Prometheus text format, only scrapes pay for adding up the shards
+std::shared_ptr<const Cached_file> Service::metrics_page(const Service_context& context, const Listen_stats& listen)
+{
+    Metrics::Snapshot snap = context.metrics.snapshot();
+    std::string text;
+
+    auto metric = [&text](const char* name, const char* type, const char* help, const std::string& value)
+    {
+        text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        text.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+        text.append(name).append(" ").append(value).append("\n");
+    };
+
+    metric("http_connections_accepted_total", "counter", "Connections accepted.", std::to_string(snap.accepts));
+    metric("http_accept_errors_total", "counter", "Accepts that failed.", std::to_string(snap.accept_errors));
+    metric("http_connections_rejected_total", "counter", "Connections answered with 503 because a connection limit was reached.", std::to_string(snap.rejects));
+    metric("http_connections_active", "gauge", "Connections currently open.", std::to_string(snap.active));
+    metric("http_listen_queue_length", "gauge", "Connections waiting in the accept queues.", std::to_string(listen.queued));
+    metric("http_listen_backlog", "gauge", "Size of the accept queues.", std::to_string(listen.backlog));
+    metric("tcp_listen_overflows_total", "counter", "Connections dropped by the host because an accept queue was full.", std::to_string(listen.overflows));
+    metric("tcp_listen_drops_total", "counter", "Connections dropped by the host while listening, overflows included.", std::to_string(listen.drops));
+    metric("http_received_bytes_total", "counter", "Bytes of request heads received.", std::to_string(snap.bytes_in));
+    metric("http_sent_bytes_total", "counter", "Bytes of responses sent.", std::to_string(snap.bytes_out));
+    metric("http_worker_queue_depth", "gauge", "Jobs waiting for a worker thread.", std::to_string(context.workers.queue_depth()));
+    metric("http_access_log_dropped_total", "counter", "Access log records dropped because the log was full.", std::to_string(context.access_log.dropped()));
+    Response_cache::Counters cache = context.responses.counters();
+    metric("http_response_cache_hits_total", "counter", "Cached handler responses served fresh.", std::to_string(cache.hits));
+    metric("http_response_cache_stale_total", "counter", "Cached handler responses served stale while a new one was rendered.", std::to_string(cache.stale));
+    metric("http_response_cache_misses_total", "counter", "Cached handler requests that rendered the response.", std::to_string(cache.misses));
+    metric("http_response_cache_coalesced_total", "counter", "Cached handler requests that waited for a render already running.", std::to_string(cache.coalesced));
+    metric("http_response_cache_entries", "gauge", "Responses in the response cache.", std::to_string(cache.entries));
+
+    text.append("# HELP http_responses_total Responses sent by status code.\n");
+    text.append("# TYPE http_responses_total counter\n");
+    for (std::size_t i = 0; i < std::size(http_table_g); i++)
+    {
+        text.append("http_responses_total{code=\"").append(std::to_string(http_table_g[i].code)).append("\"} ");
+        text.append(std::to_string(snap.responses[i])).append("\n");
+    }
+
+    text.append("# HELP http_request_duration_seconds Time from a request head arriving to its response being sent.\n");
+    text.append("# TYPE http_request_duration_seconds histogram\n");
+    append_duration_histogram(text, "http_request_duration_seconds", "", snap.latency.data(), snap.latency_count, snap.latency_sum_ns);
+
+#if defined(SERVER_STAGE_TIMING)
+    std::vector<Stage_timing::Stage_totals> stages = context.stages.snapshot();
+    text.append("# HELP http_request_stage_seconds Time a request spent in each stage of being served.\n");
+    text.append("# TYPE http_request_stage_seconds histogram\n");
+    for (std::size_t i = 0; i < stages.size(); i++)
+    {
+        std::string label = std::string("stage=\"") + Stage_timing::stage_name(i) + "\"";
+        append_duration_histogram(text, "http_request_stage_seconds", label.c_str(), stages[i].buckets.data(), stages[i].count, stages[i].sum_ns);
+    }
+#endif
+
+    auto page = std::make_shared<Cached_file>();
+    page->size = text.size();
+    page->headers = "content-type: text/plain; version=0.0.4\r\n";
+    page->length_header = "content-length: " + std::to_string(text.size()) + "\r\n";
+    page->body = std::move(text);
+    return page;
+}
+
+// Puts the connection's deadline timeout from now, replacing whichever deadline was set before
+void Service::arm_deadline(std::chrono::milliseconds timeout)
+{
+    wheel.arm(deadline, timeout);
+}
+
+// Called by the timing wheel when a deadline passes, the connection is closed on its own strand
+// and the Service reclaimed once its outstanding operations have come back aborted
+void Service::deadline_expired(void* owner, std::uint64_t generation)
+{
+    Service* service = static_cast<Service*>(owner);
+    asio::post(service->bind_handler([service, generation]()
+    {
+        // The connection may have moved on and armed a new deadline after this one fired
+        if (generation == service->deadline.generation)
+        {
+            service->cleanup();
+        }
+    }));
+}
+
+// Clears everything left over from the previous request, bytes already buffered for the next one are kept
+void Service::reset_request()
+{
+    if (!head_consumed)
+    {
+        request.consume(request_header.length);
+    }
+    head_consumed = false;
+    request_header.clear();
+    r_header.clear();
+    timing.clear();
+    url.clear();
+    r_file.reset();
+    if (r_fd >= 0)
+    {
+        ::close(r_fd);
+        r_fd = -1;
+    }
+    r_offset = 0;
+    r_remaining = 0;
+    r_bytes_sent = 0;
+    r_body = std::string_view();
+    r_ranges.count = 0;
+    r_multipart.clear();
+    r_parts.clear();
+    r_part = 0;
+    r_content_length = 0;
+    status_code = 200;
+    keep_alive = false;
+}
+
+//closes the socket and deletes the instance of service object once no handlers are outstanding
 void Service::cleanup()
 {
-    delete this;
+    if (!closing)
+    {
+        closing = true;
+        boost::system::error_code ignored;
+        if (uring != nullptr)
+        {
+            // Closing the descriptor does not end a receive or send io_uring has in flight, a shutdown does
+            client_sock.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+        }
+        client_sock.close(ignored);
+        wheel.cancel(deadline);
+    }
+
+    if (pending_ops == 0)
+    {
+        metrics.connection_closed();
+        admission.release(admission_ticket);
+        reset_request();
+        delete this;
+    }
+}
+
+
+//the client's address is only looked up when there is a per address limit, and kept for the access log
+Admission::Result Service::admit(bool reserved)
+{
+    asio::ip::address source;
+    if (admission.limits_sources())
+    {
+        boost::system::error_code ignored;
+        asio::ip::tcp::endpoint peer = client_sock.remote_endpoint(ignored);
+        source = peer.address();
+        if (source.is_v4())
+        {
+            peer_address = source.to_v4().to_uint();
+        }
+        peer_port = peer.port();
+    }
+    return admission.admit(source, admission_ticket, reserved);
+}
+
+//one non-blocking send of a ready made response, a client whose buffer is full just sees the close
+void Service::turn_away(asio::ip::tcp::socket& socket)
+{
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nretry-after: 1\r\ncontent-length: 0\r\nconnection: close\r\n\r\n";
+    ::send(socket.native_handle(), response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
-    
 
 
 //// ACCEPTOR private bits /////
 
+//Deferred accept and fast open are set on the listening socket, before listen() so a new socket
+//never queues a connection without them
+void Acceptor::Set_listen_options()
+{
+    int fd = c_acceptor.native_handle();
+    const Server_options& options = context.options;
+    if (options.tcp_defer_accept > 0 && ::setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options.tcp_defer_accept, sizeof(int)) != 0)
+    {
+        server_log().warn("TCP_DEFER_ACCEPT could not be set: {}", std::strerror(errno));
+    }
+    if (options.tcp_fastopen > 0 && ::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &options.tcp_fastopen, sizeof(int)) != 0)
+    {
+        server_log().warn("TCP_FASTOPEN could not be set: {}", std::strerror(errno));
+    }
+}
+
 //Listens for connections then when accepted exectues on_accept
-void Acceptor::Conn_Accept()
+//the client is accepted straight into the socket of a new Service, or into the call's own socket
+//when connections are served by coroutines
+void Acceptor::Conn_Accept(Accept_call& call)
 {
-    std::shared_ptr<asio::ip::tcp::socket> client(new asio::ip::tcp::socket(ioc));
-    c_acceptor.async_accept(*client.get(), [this, client] (const boost::system::error_code& error)
+    //unless extra connections are turned away, an accept takes its place in the budget first and
+    //waits for one when there is none, so every connection it brings in can be served
+    call.reserved = !context.options.reject_when_full && context.admission.limits_connections();
+    if (call.reserved && !context.admission.reserve())
+    {
+        call.reserved = false;
+        Pause_accept(call);
+        return;
+    }
+    if (!context.options.coroutine_service)
+    {
+        call.service = new Service(ioc, context, wheel, uring);
+    }
+    //a full ring leaves the accept to epoll
+    if (uring != nullptr && uring->accept(c_acceptor.native_handle(), call))
+    {
+        return;
+    }
+    c_acceptor.async_accept(call.service ? call.service->socket() : call.socket, [this, &call] (const boost::system::error_code& error)
     {
-        On_Accept(error, client);
+        On_Accept(error, call);
     });
 }
 
 
 //Once accepeted the On_Accept starts the client handle which runs the service of the server and handles requests
 //however if connection is closed then closes connections
-void Acceptor::On_Accept(const boost::system::error_code&ec, std::shared_ptr<asio::ip::tcp::socket> client)
+//runs on whichever thread completed the accept, only putting the accept back in flight goes through the
+//acceptor's strand, so connections accepted together are set up on several threads at once
+void Acceptor::On_Accept(const boost::system::error_code&ec, Accept_call& call)
+{
+    Service* service = call.service;
+    bool reserved = call.reserved;
+    call.service = nullptr;
+    call.reserved = false;
+    //the call's socket is moved out before the next accept goes into it
+    asio::ip::tcp::socket accepted(std::move(call.socket));
+    asio::post(strand, [this, &call]()
+    {
+        Resume_accept(call);
+    });
+    Start_connection(ec, service, accepted, reserved);
+}
+
+//puts the accept back in flight, or closes the acceptor once it has been stopped, runs on the acceptor's strand
+void Acceptor::Resume_accept(Accept_call& call)
+{
+    if (!is_Stopped.load()) 
+    {
+        Conn_Accept(call);
+        return;
+    }
+    boost::system::error_code ignored;
+    c_acceptor.close(ignored);
+}
+
+//admits a connection that has just been accepted and starts serving it, or turns it away
+void Acceptor::Start_connection(const boost::system::error_code& ec, Service* service, asio::ip::tcp::socket& accepted, bool reserved)
 {
     if (ec)
     {   
-        std::cout<<"Error occured! Error Code = " << ec.value() << ". Message: " << ec.message();
+        if (reserved)
+        {
+            context.admission.unreserve();
+        }
+        //an accept cancelled by Stop() is not an error
+        if (!is_Stopped.load())
+        {
+            std::cout<<"Error occured! Error Code = " << ec.value() << ". Message: " << ec.message();
+            context.metrics.accept_failed();
+        }
+        delete service;
+        return;
     }
-    else 
-    {
-        
-        //std::shared_ptr<spdlog::logger> loggers;
-        //loggers = spdlog::get("Client");
-        //loggers->info("Client Succesfully connected");
 
-        (new Service(client))->client_handle();
+    //std::shared_ptr<spdlog::logger> loggers;
+    //loggers = spdlog::get("Client");
+    //loggers->info("Client Succesfully connected");
+
+    //over the budget or the client's own limit, told to come back later instead of slowing everyone down
+    asio::ip::tcp::socket& socket = service ? service->socket() : accepted;
+    Admission::Ticket ticket;
+    Admission::Result admitted = service ? service->admit(reserved) : Admit(socket, ticket, reserved);
+    if (admitted != Admission::admitted)
+    {
+        context.metrics.connection_rejected();
+        Service::turn_away(socket);
+        delete service;
+        return;
     }
 
-    if (!is_Stopped.load()) 
+    context.metrics.connection_opened();
+    if (context.options.tcp_nodelay)
     {
-        Conn_Accept();
+        boost::system::error_code ignored;
+        socket.set_option(asio::ip::tcp::no_delay(true), ignored);
     }
-    else 
+    if (service)
+    {
+        service->client_handle();
+        return;
+    }
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+    Coro_service::start(Coro_connection{ std::move(accepted), &context, &wheel, ticket });
+#endif
+}
+
+//takes a place in the budget for a connection that has no Service, the address is only looked up for a per address limit
+Admission::Result Acceptor::Admit(asio::ip::tcp::socket& socket, Admission::Ticket& ticket, bool reserved)
+{
+    asio::ip::address source;
+    if (context.admission.limits_sources())
     {
-        c_acceptor.close();
+        boost::system::error_code ignored;
+        source = socket.remote_endpoint(ignored).address();
     }
+    return context.admission.admit(source, ticket, reserved);
+}
+
+//the resume runs on the thread that freed a slot, the accept is put back on the acceptor's strand
+void Acceptor::Pause_accept(Accept_call& call)
+{
+    context.admission.when_room([this, &call]()
+    {
+        asio::post(strand, [this, &call]()
+        {
+            Resume_accept(call);
+        });
+    });
 }
 
+//the io_uring accept completes on whichever io_context thread reaped it and continues there like an asio accept
+void Acceptor::Uring_accepted(Uring_service::Op* op, int result)
+{
+    Accept_call& call = *static_cast<Accept_call*>(op);
+    boost::system::error_code ec;
+    if (result < 0)
+    {
+        ec.assign(-result, boost::system::system_category());
+    }
+    else
+    {
+        call.service->socket().assign(asio::ip::tcp::v4(), result, ec);
+    }
+    call.acceptor->On_Accept(ec, call);
+}
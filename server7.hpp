@@ -1,9 +1,12 @@
-#ifndef _SERVER6HEAD_
-#define _SERVER6HEAD_
+#ifndef _SERVER7HEAD_
+#define _SERVER7HEAD_
 
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <seccomp.h>
 #include <sys/prctl.h>
+#include <netinet/tcp.h>
 
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/basic_file_sink.h"
@@ -14,110 +17,735 @@
 #include <boost/asio.hpp> 
 #include <boost/filesystem.hpp>
 
+#include "file_cache.hpp"
+#include "http_parser.hpp"
+#include "service_pool.hpp"
+#include "worker_pool.hpp"
+#include "header_builder.hpp"
+#include "access_log.hpp"
+#include "timing_wheel.hpp"
+#include "metrics.hpp"
+#include "io_uring.hpp"
+#include "handoff.hpp"
+#include "router.hpp"
+#include "stage_timing.hpp"
+#include "admission.hpp"
+
 #include <fstream>
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 #include <iostream>
 #include <string>
+#include <vector>
 
 using namespace boost;
 using namespace std;
 
+// Settings the Server passes down to the Acceptor and every Service it creates
+struct Server_options {
+    // How long a kept-alive connection may wait for its next request before it is closed
+    std::chrono::milliseconds keep_alive_timeout = std::chrono::seconds(5);
+    // Time a new connection gets to send the head of its first request
+    std::chrono::milliseconds header_timeout = std::chrono::seconds(10);
+    // Time allowed between pieces of a request body
+    std::chrono::milliseconds body_timeout = std::chrono::seconds(10);
+    // Largest request body accepted, bigger ones are answered with 413
+    std::uint64_t max_body_bytes = 64 * 1024 * 1024;
+    // Time a response may go without the client taking any of it
+    std::chrono::milliseconds write_timeout = std::chrono::seconds(30);
+    // Time a request may wait on the worker pool, for its file, its body to be taken or its handler to render
+    std::chrono::milliseconds handler_timeout = std::chrono::seconds(30);
+    // Requests served on one connection before the server closes it
+    unsigned int max_keep_alive_requests = 100;
+    // Bytes of static file bodies kept in memory by the File_cache
+    std::size_t file_cache_bytes = 64 * 1024 * 1024;
+    // Files bigger than this are sent with sendfile instead of being read into memory
+    std::size_t sendfile_threshold = 1024 * 1024;
+    // Build gzip copies of cached text files on the worker pool for clients that accept gzip
+    bool background_compression = true;
+    // Number of threads running the server, 0 leaves the choice to main()
+    unsigned int threads = 0;
+    // Give every thread its own io_context and SO_REUSEPORT acceptor and pin it to a core,
+    // instead of all threads sharing one io_context and one acceptor
+    bool io_context_per_thread = false;
+    // Threads for blocking work such as reading files on a cache miss
+    unsigned int worker_threads = 4;
+    // Jobs allowed to wait for a worker before requests are turned away with 503
+    std::size_t worker_queue_depth = 1024;
+    // File the access log is appended to, empty turns the access log off
+    std::string access_log_path = "AccessLog.txt";
+    // Make request threads wait when the logs fall behind, by default records are dropped and counted
+    bool log_block_when_full = false;
+    // Path the metrics are served on in Prometheus text format, empty turns it off
+    std::string metrics_path = "/metrics";
+    // With stage timing built in (-DSERVER_STAGE_TIMING), every this many requests on a thread are kept
+    // for the Chrome trace served on trace_path, 0 keeps none
+    std::size_t trace_sample = 0;
+    std::string trace_path = "/debug/trace";
+    // Responses of cached handler routes kept at once, see Cache_policy
+    std::size_t response_cache_entries = 1024;
+    // Directory static files are served from, home.html answers / and error.html goes with 404
+    std::string document_root = "/home/cyber/http/";
+    // Accept, receive and send through io_uring, and open and read cold files with it, when the kernel
+    // supports it, otherwise and by default everything goes through asio's epoll reactor
+    bool io_uring = false;
+    // Unix socket a replacement binary connects to for the listening sockets, empty turns hot restart off
+    std::string handoff_path;
+    // How long a server that has handed its sockets over waits for its connections to finish
+    std::chrono::milliseconds drain_timeout = std::chrono::seconds(30);
+    // Accepts each acceptor keeps waiting at once, so a burst of connections is taken off the
+    // queue by several threads instead of one accept at a time
+    unsigned int accepts_in_flight = 4;
+    // Connections the kernel queues for the acceptors, capped by net.core.somaxconn
+    int listen_backlog = 4096;
+    // Send small responses straight away instead of letting Nagle hold them back
+    bool tcp_nodelay = true;
+    // Seconds the kernel holds a new connection back until its first bytes arrive, 0 turns it off
+    int tcp_defer_accept = 0;
+    // Length of the TCP Fast Open queue, requests in the SYN, 0 turns it off
+    int tcp_fastopen = 0;
+    // Serve connections with the coroutine Coro_service instead of the callback Service,
+    // needs a C++20 build and always runs on epoll
+    bool coroutine_service = false;
+    // Connections served at once, 0 leaves it to the descriptor limit
+    std::size_t max_connections = 0;
+    // Connections one client address may hold open, 0 for no limit
+    std::size_t max_connections_per_ip = 0;
+    // With the budget used up the acceptors stop accepting and leave new connections in the kernel
+    // backlog, with this set they keep accepting and answer the extra connections with 503
+    bool reject_when_full = false;
+};
+
+// Receives request bodies, one piece at a time and in order
+// The connection reads nothing more of a body until the sink has returned from the last piece,
+// so a slow sink holds back the client instead of the body piling up in memory
+class Body_sink {
+    public:
+        virtual ~Body_sink() {}
+
+        // Runs on a worker thread, data is only valid during the call
+        // last is set on the call that ends the body, size may be 0 then
+        // A request without a body, Content-Length: 0 included, never reaches the sink
+        virtual void consume(std::string_view target, const char* data, std::size_t size, bool last) = 0;
+};
+
+// Reads bodies off the connection and throws them away, what the server did before bodies were read
+class Discard_body_sink : public Body_sink {
+    public:
+        void consume(std::string_view, const char*, std::size_t, bool) override {}
+};
+
+// State owned by the Server and shared by every Service the Acceptor creates
+struct Service_context {
+    const Server_options& options;
+    File_cache& files;
+    Worker_pool& workers;
+    Access_log& access_log;
+    Metrics& metrics;
+    Body_sink& body_sink;
+    // Set once the listening sockets have gone to a new process, responses then close their connection
+    const std::atomic<bool>& draining;
+    // Compiled before the first connection is accepted, only read after that
+    const Router& router;
+    Admission& admission;
+    Stage_timing& stages;
+    Response_cache& responses;
+};
+
+// The event loggers are looked up once, every spdlog::get takes the registry lock
+inline spdlog::logger& server_log()
+{
+    static std::shared_ptr<spdlog::logger> logger = spdlog::get("Server");
+    return *logger;
+}
+
+inline spdlog::logger& client_log()
+{
+    static std::shared_ptr<spdlog::logger> logger = spdlog::get("Client");
+    return *logger;
+}
+
+// Decisions about the response to a request for a file, shared by every kind of Service
+std::shared_ptr<const Cached_file> negotiate_coding(const Http_request& request, const std::shared_ptr<const Cached_file>& file,
+                                                   const Server_options& options, File_cache& files, Worker_pool& workers);
+bool not_modified(const Http_request& request, const Cached_file& file);
+bool range_applies(const Http_request& request, const Cached_file& file);
+// Renders the response of a cached handler route on the worker pool and fills it into the response cache,
+// the request is copied first since the connection that asked may have moved on by the time it runs
+void render_into_cache(Worker_pool& workers, Response_cache& cache, const Router::Route& route, const Http_request& request,
+                       const Response_cache::Pending& pending, asio::any_io_executor executor);
+
 class Service {
     //This class handles function of the server to the clients
     //Allows the server to recieve requests, proccess it and respond with the appropriate message
 
 
     public: 
-        // Points to instance of the socket connected to a client
-        Service(std::shared_ptr<boost::asio::ip::tcp::socket> client) :
-            client_sock(client), request(4096), status_code(200), resource_size(0)
-        {};
-        // client_handle() initiates the communication with the client with the socket passed to the service class
-        void client_handle() {
-            asio::async_read_until(*client_sock.get(), request,"\r\n",[this]( const boost::system::error_code& ec, size_t bytes)
+        // Owns the socket the Acceptor accepts a client into
+        // uring is null when the server runs on epoll
+        Service(asio::io_context& ioc, Service_context& context, Timing_wheel& wheel, Uring_service* uring) :
+            client_sock(ioc), options(context.options), files(context.files), workers(context.workers), access_log(context.access_log), metrics(context.metrics), body_sink(context.body_sink), draining(context.draining), router(context.router), admission(context.admission), stages(context.stages), responses(context.responses), strand(asio::make_strand(ioc)),
+            wheel(wheel), uring(uring), request(4096), status_code(200)
+        {
+            deadline.owner = this;
+            deadline.expired = &Service::deadline_expired;
+        };
+
+        ~Service()
+        {
+            if (head_copy != nullptr)
             {
-                http_request(ec, bytes);
-            });
+                Block_pool<Buffer_allocator<char>::block_size>::deallocate(head_copy);
+            }
+        }
+
+        // Services come from a per-thread free list instead of the heap, so connection churn
+        // keeps reusing the same memory
+        static void* operator new(std::size_t)
+        {
+            return Block_pool<sizeof(Service)>::allocate();
         }
+        static void operator delete(void* p)
+        {
+            Block_pool<sizeof(Service)>::deallocate(p);
+        }
+
+        asio::ip::tcp::socket& socket() { return client_sock; }
+
+        // Takes a place in the connection budget for the client just accepted, given back in cleanup()
+        // reserved says the accept had taken the place already
+        Admission::Result admit(bool reserved);
+
+        // Answers a client that was not admitted with a 503 without reading its request,
+        // the socket is closed straight after
+        static void turn_away(asio::ip::tcp::socket& socket);
+
+        // Renders the metrics in Prometheus text format, the Server routes metrics_path to it
+        static std::shared_ptr<const Cached_file> metrics_page(const Service_context& context, const Listen_stats& listen);
+
+        // client_handle() initiates the communication with the client with the socket passed to the service class
+        // It is called again for every request that arrives on a kept-alive connection
+        void client_handle();
     
     //These private methods are to perform the receiving and processing of the requests made by the client
     //requests are parsed and executed 
     private: 
+        void read_head();
         void http_request(const boost::system::error_code& ec, std::size_t bytes);
-        void http_request_header(const boost::system::error_code& ec,std::size_t bytes);
+        bool start_body();
+        void read_body();
+        void http_request_header();
         void http_request_handle();
+        void cached_render(const Router::Route& route);
+
+        // File picked for a request and the status it is sent with
+        struct Resource_lookup {
+            std::shared_ptr<const Cached_file> file;
+            unsigned int status = 200;
+        };
+        static Resource_lookup lookup_resource(File_cache& cache, const std::string& file_path, const std::string& not_found_path);
+        void resource_found(const Resource_lookup& lookup);
         void server_response_handle();
-        void response_sent(const boost::system::error_code& ec, std::size_t bytes);
+        void prepare_multipart();
+        void send_file();
+        void send_part();
+        bool hold_response(const std::array<asio::const_buffer, 5>& buffers);
+        bool request_buffered() const;
+        void held_sent();
+        void response_sent(const boost::system::error_code& ec);
+        void record_response();
+        void record_response(unsigned int status, std::uint64_t bytes, std::chrono::steady_clock::time_point start, std::uint32_t path_id, Access_record::Method method,
+                             Request_timing& timing);
+        static Access_record::Method method_of(std::string_view method);
+        void arm_deadline(std::chrono::milliseconds timeout);
+        static void deadline_expired(void* owner, std::uint64_t generation);
+        void reset_request();
         void cleanup();
+
+        // Runs a completion handler on the connection's strand and counts it as outstanding,
+        // so cleanup() only deletes the Service once every handler has come back
+        // The operation itself is allocated from the connection's handler memory
+        template <typename Handler>
+        auto bind_handler(Handler handler)
+        {
+            ++pending_ops;
+            auto counted = [this, handler](auto&&... args) mutable
+            {
+                --pending_ops;
+                if (closing)
+                {
+                    cleanup();
+                    return;
+                }
+                handler(std::forward<decltype(args)>(args)...);
+            };
+            return asio::bind_executor(strand, Pooled_handler<decltype(counted)>{ &handler_memory, counted });
+        }
+
+        // An operation of the connection in flight on io_uring, its handler is kept inline until it completes
+        // and is then run on the connection's strand like any asio completion
+        struct Uring_call : Uring_service::Op {
+            // A receive of nothing means the peer closed, as with asio
+            bool reading = false;
+            alignas(std::max_align_t) unsigned char handler[160];
+        };
+
+        template <typename Bound>
+        static void start_call(Uring_call& call, bool reading, Bound bound)
+        {
+            static_assert(sizeof(Bound) <= sizeof(call.handler), "handler too big for a Uring_call");
+            new (call.handler) Bound(std::move(bound));
+            call.reading = reading;
+            call.complete = [](Uring_service::Op* op, int result)
+            {
+                Uring_call& call = *static_cast<Uring_call*>(op);
+                Bound* stored = reinterpret_cast<Bound*>(call.handler);
+                Bound handler(std::move(*stored));
+                stored->~Bound();
+
+                boost::system::error_code ec;
+                std::size_t bytes = 0;
+                if (result < 0)
+                {
+                    ec.assign(-result, boost::system::system_category());
+                }
+                else if (result == 0 && call.reading)
+                {
+                    ec = asio::error::eof;
+                }
+                else
+                {
+                    bytes = result;
+                }
+                auto executor = handler.get_executor();
+                asio::post(executor, [handler, ec, bytes]() mutable
+                {
+                    handler(ec, bytes);
+                });
+            };
+        }
+
+        // Takes back the handler start_call() stored, for an operation io_uring had no room for
+        template <typename Bound>
+        static Bound take_call(Uring_call& call)
+        {
+            Bound* stored = reinterpret_cast<Bound*>(call.handler);
+            Bound handler(std::move(*stored));
+            stored->~Bound();
+            return handler;
+        }
+
+        // Reads what has arrived into buffer, from io_uring when the server runs on it
+        template <typename Handler>
+        void read_some(asio::mutable_buffer buffer, Handler handler)
+        {
+            if (uring == nullptr)
+            {
+                client_sock.async_read_some(buffer, bind_handler(handler));
+                return;
+            }
+            start_call(recv_call, true, bind_handler(handler));
+            if (!uring->recv(client_sock.native_handle(), buffer.data(), buffer.size(), recv_call))
+            {
+                client_sock.async_read_some(buffer, take_call<decltype(bind_handler(handler))>(recv_call));
+            }
+        }
+
+        // Responses to pipelined requests that are written together, at most this many in one write
+        // asio hands a write at most 64 buffers, twelve responses of five buffers and a 100 Continue fit
+        static const std::size_t pipeline_depth = 12;
+
+        // The buffers waiting to go out in the next write, as a sequence asio can write without copying them
+        struct Gathered_buffers {
+            const asio::const_buffer* first;
+            const asio::const_buffer* last;
+            const asio::const_buffer* begin() const { return first; }
+            const asio::const_buffer* end() const { return last; }
+        };
+
+        // Adds buffers to the next write, empty ones are left out, returns the bytes added
+        template <typename Buffers>
+        std::size_t gather(const Buffers& buffers)
+        {
+            std::size_t bytes = 0;
+            for (const asio::const_buffer& buffer : buffers)
+            {
+                if (buffer.size() > 0)
+                {
+                    r_gather[r_gathered++] = buffer;
+                    bytes += buffer.size();
+                }
+            }
+            return bytes;
+        }
+
+        Gathered_buffers gathered() const { return Gathered_buffers{ r_gather.data() + r_gather_first, r_gather.data() + r_gathered }; }
+
+        // Writes everything gathered and then calls handler(ec, bytes written), the gathered buffers are empty again by then
+        // asio's async_write sends at most 16 buffers at a time, write_some passes all of them to one sendmsg
+        // The write timeout starts over whenever the client has taken some of it
+        template <typename Handler>
+        void write_gathered(Handler handler, std::size_t written = 0)
+        {
+            arm_deadline(options.write_timeout);
+            auto sent = [this, handler, written](const boost::system::error_code& ec, std::size_t bytes) mutable
+            {
+                written += bytes;
+                if (!ec && !consume_gathered(bytes))
+                {
+                    write_gathered(handler, written);
+                    return;
+                }
+                wheel.cancel(deadline);
+                r_gather_first = 0;
+                r_gathered = 0;
+                handler(ec, written);
+            };
+            if (uring == nullptr)
+            {
+                client_sock.async_write_some(gathered(), bind_handler(sent));
+                return;
+            }
+
+            std::memset(&r_msg, 0, sizeof(r_msg));
+            for (std::size_t i = r_gather_first; i < r_gathered; i++)
+            {
+                r_iov[i - r_gather_first].iov_base = const_cast<void*>(r_gather[i].data());
+                r_iov[i - r_gather_first].iov_len = r_gather[i].size();
+            }
+            r_msg.msg_iov = r_iov;
+            r_msg.msg_iovlen = r_gathered - r_gather_first;
+            start_call(send_call, false, bind_handler(sent));
+            if (!uring->sendmsg(client_sock.native_handle(), &r_msg, send_call))
+            {
+                client_sock.async_write_some(gathered(), take_call<decltype(bind_handler(sent))>(send_call));
+            }
+        }
+
+        // Drops what a write took from the front of the gathered buffers, true once nothing is left
+        bool consume_gathered(std::size_t bytes)
+        {
+            while (r_gather_first < r_gathered && bytes >= r_gather[r_gather_first].size())
+            {
+                bytes -= r_gather[r_gather_first++].size();
+            }
+            if (r_gather_first < r_gathered)
+            {
+                r_gather[r_gather_first] += bytes;
+            }
+            return r_gather_first == r_gathered;
+        }
     
     // Private variables that are used within the class
     private:
-        std::shared_ptr<boost::asio::ip::tcp::socket> client_sock;
-        boost::asio::streambuf request;
-        std::size_t resource_size;
-        std::map<string, string> request_header;
-        std::string r_header; 
+        asio::ip::tcp::socket client_sock;
+        const Server_options& options;
+        File_cache& files;
+        Worker_pool& workers;
+        Access_log& access_log;
+        Metrics& metrics;
+        Body_sink& body_sink;
+        const std::atomic<bool>& draining;
+        const Router& router;
+        Admission& admission;
+        Admission::Ticket admission_ticket;
+        Stage_timing& stages;
+        Response_cache& responses;
+        asio::strand<asio::io_context::executor_type> strand;
+        // Header, body, write and keep-alive deadlines all share the one timer, only one applies at a time
+        Timing_wheel& wheel;
+        Timing_wheel::Timer deadline;
+        Uring_service* uring;
+        Uring_call recv_call;
+        Uring_call send_call;
+        // What a send through io_uring is made of, the gathered buffers as iovecs
+        msghdr r_msg;
+        iovec r_iov[64];
+        Handler_memory handler_memory;
+        // Receive buffer storage is recycled through the buffer pool
+        boost::asio::basic_streambuf<Buffer_allocator<char>> request;
+        Http_parser parser;
+        Http_request request_header;
+        // A request with a body has its head copied here so the receive buffer can carry the body,
+        // taken from the buffer pool the first time the connection needs it
+        char* head_copy = nullptr;
+        bool head_consumed = false;
+        Body_decoder body;
+        // Per response header lines, connection handling and the blank line ending the header block
+        Header_builder<256> r_header;
+        // Canonical request path and the file it resolved to, both reused between requests
+        std::string r_route;
+        std::string r_path;
+        std::string r_cache_key;
         std::string url;
-        std::unique_ptr<char[]> r_buffer;
+        // Body of the file being sent, shared with the File_cache
+        std::shared_ptr<const Cached_file> r_file;
+        // Part of the file body sent along with the header, empty for streamed files
+        std::string_view r_body;
+        // Byte ranges asked for, and the parts of a multipart/byteranges response built from them
+        Byte_ranges r_ranges;
+        struct Body_part {
+            std::size_t text_offset;
+            std::size_t text_size;
+            off_t file_offset;
+            std::size_t file_size;
+        };
+        std::string r_multipart;
+        std::vector<Body_part> r_parts;
+        std::size_t r_part = 0;
+        std::uint64_t r_content_length = 0;
+        // A response held back while the pipelined requests after it are served, it keeps its own
+        // copy of the per response lines and what the access log needs once it has been sent
+        struct Held_response {
+            Header_builder<256> lines;
+            std::shared_ptr<const Cached_file> file;
+            std::chrono::steady_clock::time_point start;
+            Request_timing timing;
+            std::uint64_t bytes = 0;
+            unsigned int status = 200;
+            Access_record::Method method = Access_record::other;
+        };
+        // Reserved once, the gathered buffers point into the entries so they must never move
+        std::vector<Held_response> held;
+        std::size_t held_bytes = 0;
+        std::array<asio::const_buffer, 64> r_gather;
+        std::size_t r_gather_first = 0;
+        std::size_t r_gathered = 0;
+        // Open descriptor and progress of a streamed file
+        int r_fd = -1;
+        off_t r_offset = 0;
+        std::size_t r_remaining = 0;
         unsigned int status_code;
-        std::string status_line;
+        // For the access log and metrics, the peer is looked up once per connection
+        std::chrono::steady_clock::time_point request_start;
+        Request_timing timing;
+        std::size_t r_bytes_sent = 0;
+        std::uint32_t peer_address = 0;
+        std::uint16_t peer_port = 0;
 
+        // Keep-alive state for the connection
+        unsigned int requests_served = 0;
+        bool keep_alive = false;
+        bool closing = false;
+        // Atomic because an expired deadline counts its handler from the timing wheel's thread
+        std::atomic<unsigned int> pending_ops { 0 };
         
 };
 
-//Map of status codes the server calls upon if there is an error
-const std::map<unsigned int, string>
-        http_table_g =
+//Separates the parts of a multipart/byteranges body, never appears in a part header
+constexpr std::string_view multipart_boundary_g = "7d2f4c1a9e3b5068";
+constexpr std::string_view multipart_content_type_g = "multipart/byteranges; boundary=7d2f4c1a9e3b5068";
+static_assert(multipart_content_type_g.substr(multipart_content_type_g.size() - multipart_boundary_g.size()) == multipart_boundary_g,
+    "the multipart content type must name the boundary the parts are separated by");
+
+//Sent after a 500 status line in place of header lines that did not fit, the connection is closed after it
+constexpr std::string_view overflow_headers_g = "content-length: 0\r\nconnection: close\r\n\r\n";
+
+//Status lines the server sends, complete with the protocol version and line break so a response
+//can point straight at them
+struct Http_status {
+    unsigned int code;
+    std::string_view line;
+};
+
+constexpr Http_status http_table_g[] =
     {
-        { 200, "200 OK" },
-        { 404, "404 Not Found" },
-        { 413, "413 Request Entity Is Too Large" },
-        { 500, "500 Server Error" },
-        { 501, "501 Not Implemented" },
-        { 505, "505 HTTP Version Is Not Supported" }
+        { 200, "HTTP/1.1 200 OK\r\n" },
+        { 206, "HTTP/1.1 206 Partial Content\r\n" },
+        { 304, "HTTP/1.1 304 Not Modified\r\n" },
+        { 400, "HTTP/1.1 400 Bad Request\r\n" },
+        { 404, "HTTP/1.1 404 Not Found\r\n" },
+        { 413, "HTTP/1.1 413 Request Entity Is Too Large\r\n" },
+        { 416, "HTTP/1.1 416 Range Not Satisfiable\r\n" },
+        { 431, "HTTP/1.1 431 Request Header Fields Too Large\r\n" },
+        { 500, "HTTP/1.1 500 Server Error\r\n" },
+        { 501, "HTTP/1.1 501 Not Implemented\r\n" },
+        { 503, "HTTP/1.1 503 Service Unavailable\r\n" },
+        { 505, "HTTP/1.1 505 HTTP Version Is Not Supported\r\n" }
     };
 
+//Finds the status line for a code, codes missing from the table are sent as 500
+constexpr std::string_view http_status_line(unsigned int code)
+{
+    for (const Http_status& status : http_table_g)
+    {
+        if (status.code == code)
+        {
+            return status.line;
+        }
+    }
+    return code == 500 ? std::string_view() : http_status_line(500);
+}
+
+//Position of a code in the status table, which is also its slot in the metrics
+constexpr std::size_t http_status_index(unsigned int code)
+{
+    for (std::size_t i = 0; i < std::size(http_table_g); i++)
+    {
+        if (http_table_g[i].code == code)
+        {
+            return i;
+        }
+    }
+    return code == 500 ? 0 : http_status_index(500);
+}
+
+static_assert(std::size(http_table_g) <= Metrics::status_slots, "every status needs a metrics slot");
+
+static_assert(http_status_line(404) == "HTTP/1.1 404 Not Found\r\n", "status lines are looked up at compile time");
+
 
 class Acceptor {
     // Used for accepting new connections to the server and closing them also
+    // Several accepts are kept in flight on one socket and the io_context may be run by several threads,
+    // so starting, cancelling and closing accepts runs on the acceptor's strand
+    // An accepted connection is set up on the thread its accept completed on, off the strand
 
     public:
-        Acceptor(asio::io_context&ioc, unsigned short port) :
-        ioc(ioc),
-        c_acceptor(ioc, asio::ip::tcp::endpoint(asio::ip::address_v4::any(),port)), is_Stopped(false)
-        {}
+        Acceptor(asio::io_context&ioc, unsigned short port, Service_context& context, Timing_wheel& wheel, Uring_service* uring, bool reuse_port = false) :
+        ioc(ioc), context(context), wheel(wheel), uring(uring), strand(asio::make_strand(ioc)),
+        c_acceptor(ioc), is_Stopped(false)
+        {
+            Prepare_calls();
+            asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::any(), port);
+            c_acceptor.open(endpoint.protocol());
+            c_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+            if (reuse_port)
+            {
+                // Every acceptor binds the same port and the kernel spreads new connections between them
+                c_acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+            }
+            c_acceptor.bind(endpoint);
+        }
+
+        // Takes over a socket that is already bound and listening, handed over by the process this one replaces
+        Acceptor(asio::io_context&ioc, int listening_fd, Service_context& context, Timing_wheel& wheel, Uring_service* uring) :
+        ioc(ioc), context(context), wheel(wheel), uring(uring), strand(asio::make_strand(ioc)),
+        c_acceptor(ioc), is_Stopped(false)
+        {
+            Prepare_calls();
+            c_acceptor.assign(asio::ip::tcp::v4(), listening_fd);
+        }
+
+        // The listening descriptor, safe to call from any thread once Start() has run
+        int native_handle() { return listen_fd; }
+
+        // Adds the connections waiting in this socket's accept queue and the queue's size to stats,
+        // safe to call from any thread
+        void Queue_stats(Listen_stats& stats) const
+        {
+            tcp_info info;
+            socklen_t length = sizeof(info);
+            if (is_Stopped.load() || listen_fd < 0 || ::getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &info, &length) != 0)
+            {
+                return;
+            }
+            //for a listening socket the kernel reports the accept queue in these two fields
+            stats.queued += info.tcpi_unacked;
+            stats.backlog += info.tcpi_sacked;
+        }
 
         // Start() instructs Acceptor class to start listening and accept incoming connections
         // c_acceptor listens for incoming connections
         void Start() 
         {
-            c_acceptor.listen();
-            Conn_Accept();
+            Set_listen_options();
+            c_acceptor.listen(context.options.listen_backlog);
+            listen_fd = c_acceptor.native_handle();
+            asio::post(strand, [this]()
+            {
+                for (Accept_call& call : accept_calls)
+                {
+                    Conn_Accept(call);
+                }
+            });
         }
 
-        // Start() 
+        // Stops accepting, the pending accepts are cancelled on the acceptor's strand
+        // Only this process's descriptor is closed, a process the socket was handed to keeps listening on it
+        // An io_uring accept whose cancel finds the ring full ends with the next connection, which is dropped
         void Stop()
         {
             is_Stopped.store(true);
+            asio::post(strand, [this]()
+            {
+                for (Accept_call& call : accept_calls)
+                {
+                    if (uring != nullptr)
+                    {
+                        uring->cancel(call);
+                    }
+                }
+                boost::system::error_code ignored;
+                c_acceptor.cancel(ignored);
+            });
         }
 
     private:
+        struct Accept_call : Uring_service::Op {
+            explicit Accept_call(asio::io_context& ioc) : socket(ioc) {}
+
+            Acceptor* acceptor = nullptr;
+            Service* service = nullptr;
+            // What a coroutine served connection is accepted into, Service has a socket of its own
+            asio::ip::tcp::socket socket;
+            // Holds a place in the connection budget for the connection it will bring in
+            bool reserved = false;
+        };
+
+        void Prepare_calls()
+        {
+            std::size_t count = std::max(1u, context.options.accepts_in_flight);
+            accept_calls.reserve(count);
+            for (std::size_t i = 0; i < count; i++)
+            {
+                accept_calls.emplace_back(ioc);
+                accept_calls.back().acceptor = this;
+                accept_calls.back().complete = &Acceptor::Uring_accepted;
+            }
+        }
+
+        // Applies the listening socket options, failures are logged and the socket is used as it is
+        void Set_listen_options();
 
         // Constructs a socket and creates asynchrious accept operation
         // calls On_Accept() if connection successfuly or error occured
 
-        void Conn_Accept();
+        void Conn_Accept(Accept_call& call);
 
         // A call back method that is called once the connections has been created succesfully
         // or there was an error. Once called the method calls the client_handle method in Service to start
         // handling the client.
 
-        void On_Accept(const boost::system::error_code&ec, std::shared_ptr<asio::ip::tcp::socket> client);
+        void On_Accept(const boost::system::error_code&ec, Accept_call& call);
+        void Resume_accept(Accept_call& call);
+        void Start_connection(const boost::system::error_code& ec, Service* service, asio::ip::tcp::socket& accepted, bool reserved);
+
+        Admission::Result Admit(asio::ip::tcp::socket& socket, Admission::Ticket& ticket, bool reserved);
+
+        // Leaves call idle until the connection budget has room again, the kernel backlog holds
+        // new connections meanwhile, Conn_Accept() pauses a call itself when it finds no room
+        void Pause_accept(Accept_call& call);
+
+        // Completion of an accept submitted to io_uring, the new descriptor is handed to the Service's socket
+        static void Uring_accepted(Uring_service::Op* op, int result);
     
     private:
         asio::io_context&ioc;
+        Service_context& context;
+        Timing_wheel& wheel;
+        Uring_service* uring;
+        asio::strand<asio::io_context::executor_type> strand;
+        // One per accept kept in flight, never resized so io_uring can hold on to them
+        std::vector<Accept_call> accept_calls;
         asio::ip::tcp::acceptor c_acceptor;
+        // Copy of the listening descriptor for Queue_stats(), which runs on other threads
+        int listen_fd = -1;
         std::atomic<bool>is_Stopped;
 
 };
@@ -126,17 +754,105 @@ class Server{
     // Runs the server when called ( Start() Stop ())
 
     public:
-        Server() 
+        Server(const Server_options& options = Server_options()) :
+            options(options), files(ioc, options.file_cache_bytes, options.sendfile_threshold),
+            workers(options.worker_threads, options.worker_queue_depth),
+            access_log(options.access_log_path, options.log_block_when_full), stages(this->options.trace_sample), responses(this->options.response_cache_entries),
+            context{this->options, files, workers, access_log, metrics, body_sink, draining, router, admission, stages, responses},
+            handoff_acceptor(ioc), drain_timer(ioc)
         {
             work_reset.reset(new asio::io_context::work(ioc));
+
+            //the built in routes, anything added through Routes() before Start() replaces them
+            std::string root = this->options.document_root;
+            if (root.empty() || root.back() != '/')
+            {
+                root.push_back('/');
+            }
+            if (!this->options.metrics_path.empty())
+            {
+                router.add_handler(this->options.metrics_path, [this](const Http_request&)
+                {
+                    return Service::metrics_page(context, Listen_queue());
+                });
+            }
+#if defined(SERVER_STAGE_TIMING)
+            if (this->options.trace_sample != 0 && !this->options.trace_path.empty())
+            {
+                router.add_handler(this->options.trace_path, [this](const Http_request&)
+                {
+                    std::string json = stages.trace();
+                    auto page = std::make_shared<Cached_file>();
+                    page->size = json.size();
+                    page->headers = "content-type: application/json\r\n";
+                    page->length_header = "content-length: " + std::to_string(json.size()) + "\r\n";
+                    page->body = std::move(json);
+                    return page;
+                });
+            }
+#endif
+            router.add_file("/", root + "home.html");
+            router.add_directory("/", root);
+            router.not_found(root + "error.html");
+        }
+
+        // Static files and handlers the server answers with, only to be changed before Start()
+        Router& Routes()
+        {
+            return router;
+        }
+
+        // Listening sockets and cached paths taken over from the server this one replaces, used by Start()
+        void Inherit(Handoff handoff)
+        {
+            inherited = std::move(handoff);
         }
+
         //Start Server here
         void Start(unsigned short port, unsigned int thread_pool_size)
         {
             assert(thread_pool_size > 0);
-            //Create / start Acceptor
-            acc.reset(new Acceptor(ioc, port));
-            acc->Start();
+            router.compile();
+
+#if !defined(SERVER_STAGE_TIMING)
+            if (options.trace_sample != 0)
+            {
+                server_log().warn("stage timing is not built in, build with -DSERVER_STAGE_TIMING for a trace");
+            }
+#endif
+#if !defined(BOOST_ASIO_HAS_CO_AWAIT)
+            if (options.coroutine_service)
+            {
+                server_log().warn("the coroutine service needs a C++20 build, using the callback service");
+                options.coroutine_service = false;
+            }
+#endif
+
+            //io_uring is only used when the kernel has every operation the server needs
+            //the coroutine service does its own socket io through asio
+            use_uring = options.io_uring && !options.coroutine_service && Io_ring::supported();
+            if (options.io_uring && !use_uring)
+            {
+                server_log().warn("io_uring is not available, using epoll");
+            }
+            files.use_io_uring(use_uring);
+
+            if (options.io_context_per_thread)
+            {
+                Start_per_thread(port, thread_pool_size);
+                return;
+            }
+
+            //Create / start Acceptor, every connection's deadlines go in the one wheel
+            //sockets taken over from an old process all get an acceptor, none of them may go unserved
+            wheels.emplace_back(new Timing_wheel(ioc));
+            Uring_service* uring = start_uring(ioc);
+            do
+            {
+                Make_acceptor(ioc, port, *wheels.back(), uring, false);
+            }
+            while (next_inherited < inherited.fds.size());
+            Start_handoff();
 
             //Specified number of threads and add to pool
             //seccomp(threads, isolation)
@@ -151,24 +867,288 @@ class Server{
             }
         }
 
+        // Blocks until the server should stop, on Request_stop() or once it has handed over and drained
+        void Wait()
+        {
+            std::unique_lock<std::mutex> lock(stop_mtx);
+            stop_cv.wait(lock, [this]() { return stop_requested; });
+        }
+
+        void Request_stop()
+        {
+            std::lock_guard<std::mutex> lock(stop_mtx);
+            stop_requested = true;
+            stop_cv.notify_all();
+        }
+
         //stopping server
         void Stop()
         {
-            acc->Stop();
+            for (auto& acc : acceptors)
+            {
+                acc->Stop();
+            }
             ioc.stop();
+            for (auto& core_ioc : core_contexts)
+            {
+                core_ioc->stop();
+            }
 
             for (auto& th : m_thread_pool)
             {
                 th->join();
             }
+            workers.stop();
+            files.clear();
+            access_log.stop();
+
+            //after a handoff the socket path belongs to the new process
+            if (!options.handoff_path.empty() && handoff_acceptor.is_open() && !handed_off)
+            {
+                ::unlink(options.handoff_path.c_str());
+            }
         }
 
     private:
+        // Uses the next socket taken over from the old process if there is one, otherwise binds a new one
+        // Once the taken over sockets run out they are shared, the old process may not have set SO_REUSEPORT
+        void Make_acceptor(asio::io_context& thread_ioc, unsigned short port, Timing_wheel& wheel, Uring_service* uring, bool reuse_port)
+        {
+            std::unique_ptr<Acceptor> acceptor;
+            if (!inherited.fds.empty())
+            {
+                int fd = next_inherited < inherited.fds.size() ? inherited.fds[next_inherited++]
+                    : ::fcntl(inherited.fds[acceptors.size() % inherited.fds.size()], F_DUPFD_CLOEXEC, 0);
+                acceptor.reset(new Acceptor(thread_ioc, fd, context, wheel, uring));
+            }
+            else
+            {
+                acceptor.reset(new Acceptor(thread_ioc, port, context, wheel, uring, reuse_port));
+            }
+            acceptor->Start();
+            std::lock_guard<std::mutex> lock(acceptors_mtx);
+            acceptors.push_back(std::move(acceptor));
+        }
+
+        // Accept queue figures for the metrics page, scrapes may come in while acceptors are still being started
+        Listen_stats Listen_queue()
+        {
+            Listen_stats stats;
+            {
+                std::lock_guard<std::mutex> lock(acceptors_mtx);
+                for (auto& acc : acceptors)
+                {
+                    acc->Queue_stats(stats);
+                }
+            }
+            stats.read_netstat();
+            return stats;
+        }
+
+        // Listens on the handoff socket for the binary that will replace this one, and warms the
+        // file cache with what the replaced server had cached
+        void Start_handoff()
+        {
+            if (!inherited.fds.empty())
+            {
+                server_log().info("Took over {} listening sockets, warming {} cached files", inherited.fds.size(), inherited.paths.size());
+            }
+            for (const std::string& path : inherited.paths)
+            {
+                File_cache& cache = files;
+                if (!workers.post([&cache, path]() { cache.get(path); }))
+                {
+                    break;
+                }
+            }
+
+            if (options.handoff_path.empty())
+            {
+                return;
+            }
+            ::unlink(options.handoff_path.c_str());
+            boost::system::error_code ec;
+            asio::local::stream_protocol::endpoint endpoint(options.handoff_path);
+            handoff_acceptor.open(endpoint.protocol(), ec);
+            if (!ec)
+            {
+                handoff_acceptor.bind(endpoint, ec);
+            }
+            if (!ec)
+            {
+                handoff_acceptor.listen(asio::socket_base::max_listen_connections, ec);
+            }
+            if (ec)
+            {
+                server_log().warn("Handoff socket {} unavailable: {}", options.handoff_path, ec.message());
+                handoff_acceptor.close(ec);
+                return;
+            }
+            Handoff_accept();
+        }
+
+        // A connection on the handoff socket is the new binary asking for the listening sockets
+        void Handoff_accept()
+        {
+            handoff_acceptor.async_accept([this](const boost::system::error_code& ec, asio::local::stream_protocol::socket peer)
+            {
+                if (ec)
+                {
+                    return;
+                }
+                std::vector<int> fds;
+                for (auto& acc : acceptors)
+                {
+                    fds.push_back(acc->native_handle());
+                }
+                if (!Handoff::send(peer.native_handle(), fds, files.cached_paths(handoff_warm_files)))
+                {
+                    server_log().warn("Handoff to the new process failed, still serving");
+                    Handoff_accept();
+                    return;
+                }
+                server_log().info("Handed {} listening sockets to the new process, draining", fds.size());
+                handed_off = true;
+                boost::system::error_code ignored;
+                handoff_acceptor.close(ignored);
+                Drain();
+            });
+        }
+
+        // Stops accepting and lets the open connections finish, responses from now on close their
+        // connection, and the server stops once none are left or the drain timeout passes
+        void Drain()
+        {
+            draining = true;
+            for (auto& acc : acceptors)
+            {
+                acc->Stop();
+            }
+            drain_deadline = std::chrono::steady_clock::now() + options.drain_timeout;
+            Drain_wait();
+        }
+
+        void Drain_wait()
+        {
+            if (metrics.snapshot().active <= 0 || std::chrono::steady_clock::now() >= drain_deadline)
+            {
+                Request_stop();
+                return;
+            }
+            drain_timer.expires_after(std::chrono::milliseconds(100));
+            drain_timer.async_wait([this](const boost::system::error_code& ec)
+            {
+                if (!ec)
+                {
+                    Drain_wait();
+                }
+            });
+        }
+
+        // The io_uring service for an io_context, or null when the server runs on epoll
+        Uring_service* start_uring(asio::io_context& thread_ioc)
+        {
+            if (!use_uring)
+            {
+                return nullptr;
+            }
+            urings.emplace_back(new Uring_service(thread_ioc));
+            if (!urings.back()->is_open())
+            {
+                server_log().warn("io_uring could not be set up, using epoll");
+                urings.pop_back();
+                return nullptr;
+            }
+            return urings.back().get();
+        }
+
+        // One io_context, acceptor and pinned thread per core, a connection stays on the thread that accepted it
+        // The first thread runs the server's own io_context so the file cache watcher keeps working
+        void Start_per_thread(unsigned short port, unsigned int thread_count)
+        {
+            unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+            std::vector<asio::io_context*> thread_iocs;
+            std::vector<Uring_service*> thread_urings;
+
+            for (unsigned int i = 0; i < thread_count; i++)
+            {
+                asio::io_context* thread_ioc = &ioc;
+                if (i > 0)
+                {
+                    core_contexts.emplace_back(new asio::io_context(1));
+                    core_work.emplace_back(new asio::io_context::work(*core_contexts.back()));
+                    thread_ioc = core_contexts.back().get();
+                }
+
+                wheels.emplace_back(new Timing_wheel(*thread_ioc));
+                thread_iocs.push_back(thread_ioc);
+                thread_urings.push_back(start_uring(*thread_ioc));
+                Make_acceptor(*thread_ioc, port, *wheels.back(), thread_urings.back(), true);
+
+                std::unique_ptr<std::thread> th(new std::thread([thread_ioc]()
+                {
+                    thread_ioc->run();
+                }));
+
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(i % cores, &cpus);
+                pthread_setaffinity_np(th->native_handle(), sizeof(cpus), &cpus);
+
+                m_thread_pool.push_back(std::move(th));
+            }
+
+            //an old process that ran more threads handed over more sockets, they are shared out between the threads
+            for (std::size_t i = 0; next_inherited < inherited.fds.size(); i++)
+            {
+                std::size_t t = i % thread_iocs.size();
+                Make_acceptor(*thread_iocs[t], port, *wheels[t], thread_urings[t], true);
+            }
+            Start_handoff();
+        }
+
+    private:
+        Server_options options;
         asio::io_context ioc;
+        File_cache files;
+        Worker_pool workers;
+        Access_log access_log;
+        Metrics metrics;
+        Discard_body_sink body_sink;
+        std::atomic<bool> draining { false };
+        Router router;
+        Admission admission { options.max_connections, options.max_connections_per_ip };
+        Stage_timing stages;
+        Response_cache responses;
+        Service_context context;
         std::unique_ptr<asio::io_context::work>work_reset;
-        std::unique_ptr<Acceptor>acc;
+
+        // Hot restart, the sockets taken over at start and the handoff to the next process
+        // Files the new process is told to load, most recently used first
+        static const std::size_t handoff_warm_files = 4096;
+        Handoff inherited;
+        std::size_t next_inherited = 0;
+        asio::local::stream_protocol::acceptor handoff_acceptor;
+        bool handed_off = false;
+        asio::steady_timer drain_timer;
+        std::chrono::steady_clock::time_point drain_deadline;
+        std::mutex stop_mtx;
+        std::condition_variable stop_cv;
+        bool stop_requested = false;
+
+        // Extra io_contexts used when every thread has its own, declared before everything
+        // that holds i/o objects on them so they are destroyed last
+        std::vector<std::unique_ptr<asio::io_context>>core_contexts;
+        std::vector<std::unique_ptr<asio::io_context::work>>core_work;
+
+        // One timing wheel per io_context, and one io_uring service when the server runs on io_uring
+        std::vector<std::unique_ptr<Timing_wheel>>wheels;
+        bool use_uring = false;
+        std::vector<std::unique_ptr<Uring_service>>urings;
+        std::vector<std::unique_ptr<Acceptor>>acceptors;
+        std::mutex acceptors_mtx;
         std::vector<std::unique_ptr<std::thread>>m_thread_pool;
 
 };
 
-#endif  // _SERVER6HEAD_
\ No newline at end of file
+#endif  // _SERVER7HEAD_
\ No newline at end of file
@@ -0,0 +1,207 @@
+#ifndef _SERVICEPOOLHEAD_
+#define _SERVICEPOOLHEAD_
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+// Fixed size blocks recycled through a free list owned by each thread
+// A block freed on another thread than the one that took it joins that thread's list,
+// so blocks move freely between threads and the lists need no locking
+template <std::size_t Size>
+class Block_pool {
+    public:
+        static void* allocate()
+        {
+            Free_list& list = free_list();
+            if (list.head == nullptr)
+            {
+                return ::operator new(Size);
+            }
+            Node* node = list.head;
+            list.head = node->next;
+            list.count--;
+            return node;
+        }
+
+        static void deallocate(void* p)
+        {
+            Free_list& list = free_list();
+            if (list.count >= max_cached)
+            {
+                ::operator delete(p);
+                return;
+            }
+            Node* node = static_cast<Node*>(p);
+            node->next = list.head;
+            list.head = node;
+            list.count++;
+        }
+
+    private:
+        struct Node {
+            Node* next;
+        };
+
+        struct Free_list {
+            Node* head = nullptr;
+            std::size_t count = 0;
+
+            ~Free_list()
+            {
+                while (head != nullptr)
+                {
+                    Node* next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+            }
+        };
+
+        static_assert(Size >= sizeof(Node), "blocks must be able to hold a free list link");
+
+        // Blocks kept per thread, anything freed beyond that goes back to the heap
+        static const std::size_t max_cached = 1024;
+
+        static Free_list& free_list()
+        {
+            thread_local Free_list list;
+            return list;
+        }
+};
+
+// Allocator for receive buffers, requests up to block_size bytes are served from a Block_pool
+template <typename T>
+struct Buffer_allocator {
+    typedef T value_type;
+    static const std::size_t block_size = 4096;
+
+    Buffer_allocator() = default;
+    template <typename U>
+    Buffer_allocator(const Buffer_allocator<U>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        if (n * sizeof(T) <= block_size)
+        {
+            return static_cast<T*>(Block_pool<block_size>::allocate());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (n * sizeof(T) <= block_size)
+        {
+            Block_pool<block_size>::deallocate(p);
+            return;
+        }
+        ::operator delete(p);
+    }
+
+    template <typename U>
+    bool operator==(const Buffer_allocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const Buffer_allocator<U>&) const { return false; }
+};
+
+// Memory for the asynchronous operations of one connection
+// A connection has at most a few operations outstanding, each one gets a slot and only
+// operations bigger than a slot or beyond the slot count fall back to the heap
+// Slots are freed from whichever thread completes the operation, so they are claimed atomically
+class Handler_memory {
+    public:
+        Handler_memory() = default;
+        Handler_memory(const Handler_memory&) = delete;
+        Handler_memory& operator=(const Handler_memory&) = delete;
+
+        void* allocate(std::size_t size)
+        {
+            if (size <= slot_size)
+            {
+                for (Slot& slot : slots)
+                {
+                    bool expected = false;
+                    if (slot.in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                    {
+                        return slot.storage;
+                    }
+                }
+            }
+            return ::operator new(size);
+        }
+
+        void deallocate(void* p)
+        {
+            for (Slot& slot : slots)
+            {
+                if (p == slot.storage)
+                {
+                    slot.in_use.store(false, std::memory_order_release);
+                    return;
+                }
+            }
+            ::operator delete(p);
+        }
+
+    private:
+        static const std::size_t slot_size = 512;
+        static const std::size_t slot_count = 4;
+
+        struct Slot {
+            alignas(std::max_align_t) unsigned char storage[slot_size];
+            std::atomic<bool> in_use { false };
+        };
+
+        Slot slots[slot_count];
+};
+
+// Allocator that asio picks up through associated_allocator to place operations in Handler_memory
+template <typename T>
+struct Handler_allocator {
+    typedef T value_type;
+
+    explicit Handler_allocator(Handler_memory& memory) : memory(&memory) {}
+    template <typename U>
+    Handler_allocator(const Handler_allocator<U>& other) : memory(other.memory) {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(memory->allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* p, std::size_t)
+    {
+        memory->deallocate(p);
+    }
+
+    template <typename U>
+    bool operator==(const Handler_allocator<U>& other) const { return memory == other.memory; }
+    template <typename U>
+    bool operator!=(const Handler_allocator<U>& other) const { return memory != other.memory; }
+
+    Handler_memory* memory;
+};
+
+// Completion handler that allocates its operations from a connection's Handler_memory
+template <typename Handler>
+struct Pooled_handler {
+    typedef Handler_allocator<Handler> allocator_type;
+
+    allocator_type get_allocator() const
+    {
+        return allocator_type(*memory);
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args)
+    {
+        handler(std::forward<Args>(args)...);
+    }
+
+    Handler_memory* memory;
+    Handler handler;
+};
+
+#endif  // _SERVICEPOOLHEAD_
@@ -0,0 +1,278 @@
+#ifndef _STAGETIMINGHEAD_
+#define _STAGETIMINGHEAD_
+
+#include "latency_histogram.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Where the time of a request goes, stage by stage
+// Built in only when the server is compiled with -DSERVER_STAGE_TIMING, without it Request_timing
+// and Stage_timing are empty and every call on them compiles to nothing
+
+#if defined(SERVER_STAGE_TIMING)
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+class Stage_clock {
+    // Ticks of the time stamp counter where there is one, steady_clock nanoseconds elsewhere
+    // Reading the TSC takes a few nanoseconds and no system call, it is assumed to tick at the same
+    // constant rate on every core, as it does on any x86 of the last decade
+    public:
+        static std::uint64_t now()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+        }
+
+        // Measured against steady_clock the first time it is asked for
+        static double ns_per_tick()
+        {
+            static const double ratio = calibrate();
+            return ratio;
+        }
+
+    private:
+        static double calibrate()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            auto start = std::chrono::steady_clock::now();
+            std::uint64_t first = now();
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            std::uint64_t last = now();
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            return last > first ? static_cast<double>(elapsed) / (last - first) : 1.0;
+#else
+            return 1.0;
+#endif
+        }
+};
+
+// Clock readings taken as one request goes through the server, kept inline in the connection
+// A mark the request never reached stays 0 and the stages on either side of it are left out
+struct Request_timing {
+    enum Mark { waiting, head, parsed, body, resolved, writing, sent, mark_count };
+
+    std::array<std::uint64_t, mark_count> at {};
+
+    void mark(Mark m)
+    {
+        at[m] = Stage_clock::now();
+    }
+
+    void clear()
+    {
+        at.fill(0);
+    }
+};
+
+class Stage_timing {
+    // A histogram of every stage, the time from one mark of Request_timing to the next, kept in
+    // per-thread shards like Metrics so recording takes no lock
+    // Every sample-th request of a thread is also copied whole into a ring of recent requests, which
+    // trace() renders as Chrome trace events
+
+    public:
+        static const bool enabled = true;
+        static const std::size_t stage_count = Request_timing::mark_count - 1;
+        // Sampled requests kept for the trace, the oldest are overwritten
+        static const std::size_t trace_capacity = 4096;
+
+        // wait ends once the whole head is in, so it takes in the idle time of a kept-alive connection,
+        // body ends once the body sink is done, lookup once the file or handler answer is in hand, and
+        // render once the response is ready to be written
+        static const char* stage_name(std::size_t stage)
+        {
+            static const char* names[stage_count] = { "wait", "parse", "body", "lookup", "render", "write" };
+            return names[stage];
+        }
+
+        struct Stage_totals {
+            std::array<std::uint64_t, Latency_histogram::bucket_count> buckets {};
+            std::uint64_t count = 0;
+            std::uint64_t sum_ns = 0;
+        };
+
+        // sample of 0 keeps no requests for the trace
+        explicit Stage_timing(std::size_t sample) :
+            sample(sample), origin(Stage_clock::now()), ns_per_tick(Stage_clock::ns_per_tick())
+        {
+            if (sample != 0)
+            {
+                samples.reserve(trace_capacity);
+            }
+        }
+
+        // lane is the connection the request came in on, each connection gets its own row in the trace
+        void record(const Request_timing& timing, int lane, unsigned int status)
+        {
+            Shard& s = shard();
+            for (std::size_t i = 0; i < stage_count; i++)
+            {
+                std::uint64_t from = timing.at[i];
+                std::uint64_t to = timing.at[i + 1];
+                if (from == 0 || to < from)
+                {
+                    continue;
+                }
+                std::uint64_t ns = static_cast<std::uint64_t>((to - from) * ns_per_tick);
+                bump(s.stages[i].buckets[Latency_histogram::index_of(ns)], 1);
+                bump(s.stages[i].count, 1);
+                bump(s.stages[i].sum_ns, ns);
+            }
+
+            if (sample != 0 && ++s.seen >= sample)
+            {
+                s.seen = 0;
+                keep(timing, lane, status);
+            }
+        }
+
+        std::vector<Stage_totals> snapshot() const
+        {
+            std::vector<Stage_totals> total(stage_count);
+            std::lock_guard<std::mutex> lock(shards_mtx);
+            for (auto& s : shards)
+            {
+                for (std::size_t i = 0; i < stage_count; i++)
+                {
+                    for (std::size_t b = 0; b < Latency_histogram::bucket_count; b++)
+                    {
+                        total[i].buckets[b] += s->stages[i].buckets[b].load(std::memory_order_relaxed);
+                    }
+                    total[i].count += s->stages[i].count.load(std::memory_order_relaxed);
+                    total[i].sum_ns += s->stages[i].sum_ns.load(std::memory_order_relaxed);
+                }
+            }
+            return total;
+        }
+
+        // The sampled requests in the Chrome trace event format, for chrome://tracing or Perfetto
+        // Times are in microseconds from when the server started
+        std::string trace() const
+        {
+            std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+            std::lock_guard<std::mutex> lock(samples_mtx);
+            char event[256];
+            bool first = true;
+            for (const Sample& sampled : samples)
+            {
+                for (std::size_t i = 0; i < stage_count; i++)
+                {
+                    std::uint64_t from = sampled.timing.at[i];
+                    std::uint64_t to = sampled.timing.at[i + 1];
+                    if (from < origin || to < from)
+                    {
+                        continue;
+                    }
+                    int n = std::snprintf(event, sizeof(event),
+                        "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"status\":%u}}",
+                        first ? "" : ",", stage_name(i), sampled.lane, (from - origin) * ns_per_tick / 1000.0,
+                        (to - from) * ns_per_tick / 1000.0, sampled.status);
+                    json.append(event, n);
+                    first = false;
+                }
+            }
+            json.append("]}\n");
+            return json;
+        }
+
+    private:
+        struct Stage_counts {
+            std::atomic<std::uint64_t> buckets[Latency_histogram::bucket_count] = {};
+            std::atomic<std::uint64_t> count { 0 };
+            std::atomic<std::uint64_t> sum_ns { 0 };
+        };
+
+        struct alignas(64) Shard {
+            Stage_counts stages[stage_count];
+            // Requests recorded since the last one was sampled, only the owning thread touches it
+            std::size_t seen = 0;
+        };
+
+        struct Sample {
+            Request_timing timing;
+            int lane;
+            unsigned int status;
+        };
+
+        // Sampled requests are few, so the ring can make do with a lock
+        void keep(const Request_timing& timing, int lane, unsigned int status)
+        {
+            std::lock_guard<std::mutex> lock(samples_mtx);
+            if (samples.size() < trace_capacity)
+            {
+                samples.push_back(Sample{ timing, lane, status });
+                return;
+            }
+            samples[next_sample] = Sample{ timing, lane, status };
+            next_sample = (next_sample + 1) % trace_capacity;
+        }
+
+        // Only the owning thread writes a shard, so a load and store is enough and avoids a locked add
+        template <typename T, typename D>
+        static void bump(std::atomic<T>& value, D delta)
+        {
+            value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        }
+
+        Shard& shard()
+        {
+            thread_local const Stage_timing* owner = nullptr;
+            thread_local Shard* current = nullptr;
+            if (owner != this)
+            {
+                std::lock_guard<std::mutex> lock(shards_mtx);
+                shards.emplace_back(new Shard());
+                current = shards.back().get();
+                owner = this;
+            }
+            return *current;
+        }
+
+        const std::size_t sample;
+        const std::uint64_t origin;
+        const double ns_per_tick;
+        mutable std::mutex shards_mtx;
+        std::vector<std::unique_ptr<Shard>> shards;
+        mutable std::mutex samples_mtx;
+        std::vector<Sample> samples;
+        std::size_t next_sample = 0;
+};
+
+#else
+
+struct Request_timing {
+    enum Mark { waiting, head, parsed, body, resolved, writing, sent, mark_count };
+
+    void mark(Mark) {}
+    void clear() {}
+};
+
+class Stage_timing {
+    public:
+        static const bool enabled = false;
+
+        explicit Stage_timing(std::size_t) {}
+
+        void record(const Request_timing&, int, unsigned int) {}
+};
+
+#endif  // SERVER_STAGE_TIMING
+
+#endif  // _STAGETIMINGHEAD_
@@ -0,0 +1,198 @@
+#ifndef _TIMINGWHEELHEAD_
+#define _TIMINGWHEELHEAD_
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+class Timing_wheel {
+    // Hierarchical timing wheel for connection deadlines, one per io_context
+    // Four levels of 64 slots, a timer sits in the level picked by how far away its deadline is and
+    // moves down a level each time the level above turns over, so arming and cancelling are O(1)
+    // and a tick only touches the slot that is due
+    // One steady_timer drives the wheel, connections never put anything in the io_context timer queue
+    // Timers are intrusive, the owner keeps the Timer and the wheel only links it into a slot
+
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        struct Timer {
+            // Called on the wheel's thread with the wheel locked, so the owner can not be
+            // deleted before the call returns as long as it cancels the timer first
+            // It must not arm or cancel timers itself, only hand the work on, e.g. post to a strand
+            void (*expired)(void* owner, std::uint64_t generation) = nullptr;
+            void* owner = nullptr;
+            // Bumped every time the timer is armed or cancelled, lets a stale expiry be told apart from the current one
+            std::uint64_t generation = 0;
+
+            bool armed() const { return pprev != nullptr; }
+
+        private:
+            friend class Timing_wheel;
+            Timer* next = nullptr;
+            Timer** pprev = nullptr;
+            std::uint64_t deadline = 0;
+        };
+
+        static const unsigned int slot_bits = 6;
+        static const std::size_t slots = 1 << slot_bits;
+        static const unsigned int levels = 4;
+
+        Timing_wheel(boost::asio::io_context& ioc, clock::duration tick = std::chrono::milliseconds(100)) :
+            tick(tick), ticker(ioc), started(clock::now())
+        {
+            wait_tick();
+        }
+
+        // Returns the generation the timer was armed with
+        std::uint64_t arm(Timer& timer, clock::duration timeout)
+        {
+            std::uint64_t ticks = (timeout + tick - clock::duration(1)) / tick;
+            // Deadlines further out than the top level can tell apart are pulled in
+            std::uint64_t limit = (std::uint64_t(slots - 2) << (slot_bits * (levels - 1)));
+            std::lock_guard<std::mutex> lock(mtx);
+            if (timer.armed())
+            {
+                unlink(timer);
+                count--;
+            }
+            timer.deadline = now + (ticks == 0 ? 1 : ticks < limit ? ticks : limit);
+            link(timer);
+            count++;
+            return ++timer.generation;
+        }
+
+        // Also bumps the generation, so an expiry already handed on before the cancel is seen as stale
+        void cancel(Timer& timer)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (timer.armed())
+            {
+                unlink(timer);
+                count--;
+            }
+            ++timer.generation;
+        }
+
+        // Timers currently armed
+        std::size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return count;
+        }
+
+        void stop()
+        {
+            boost::system::error_code ignored;
+            ticker.cancel(ignored);
+        }
+
+    private:
+        void wait_tick()
+        {
+            ticker.expires_at(started + tick * (now + 1));
+            ticker.async_wait([this](const boost::system::error_code& ec)
+            {
+                if (ec)
+                {
+                    return;
+                }
+                // Catch up on ticks missed while the thread was busy
+                std::uint64_t due = (clock::now() - started) / tick;
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    while (now < due)
+                    {
+                        advance();
+                    }
+                }
+                wait_tick();
+            });
+        }
+
+        // Moves the wheel on one tick, cascading the levels that turned over and expiring the due slot
+        void advance()
+        {
+            now++;
+
+            unsigned int top = 0;
+            while (top + 1 < levels && (now & ((std::uint64_t(1) << (slot_bits * (top + 1))) - 1)) == 0)
+            {
+                top++;
+            }
+            for (unsigned int level = top; level > 0; level--)
+            {
+                Timer* timer = wheel[level][slot_of(now, level)];
+                wheel[level][slot_of(now, level)] = nullptr;
+                while (timer != nullptr)
+                {
+                    Timer* next = timer->next;
+                    timer->pprev = nullptr;
+                    link(*timer);
+                    timer = next;
+                }
+            }
+
+            Timer*& head = wheel[0][slot_of(now, 0)];
+            while (head != nullptr)
+            {
+                Timer* timer = head;
+                unlink(*timer);
+                count--;
+                timer->expired(timer->owner, timer->generation);
+            }
+        }
+
+        // A timer goes in the lowest level whose higher digits match the current tick
+        void link(Timer& timer)
+        {
+            unsigned int level = 0;
+            while (level + 1 < levels && (timer.deadline >> (slot_bits * (level + 1))) != (now >> (slot_bits * (level + 1))))
+            {
+                level++;
+            }
+            Timer*& head = wheel[level][slot_of(timer.deadline, level)];
+            timer.next = head;
+            if (head != nullptr)
+            {
+                head->pprev = &timer.next;
+            }
+            head = &timer;
+            timer.pprev = &head;
+        }
+
+        void unlink(Timer& timer)
+        {
+            if (timer.pprev == nullptr)
+            {
+                return;
+            }
+            *timer.pprev = timer.next;
+            if (timer.next != nullptr)
+            {
+                timer.next->pprev = timer.pprev;
+            }
+            timer.next = nullptr;
+            timer.pprev = nullptr;
+        }
+
+        static std::size_t slot_of(std::uint64_t t, unsigned int level)
+        {
+            return (t >> (slot_bits * level)) & (slots - 1);
+        }
+
+    private:
+        const clock::duration tick;
+        boost::asio::steady_timer ticker;
+        const clock::time_point started;
+
+        mutable std::mutex mtx;
+        std::uint64_t now = 0;
+        std::size_t count = 0;
+        Timer* wheel[levels][slots] = {};
+};
+
+#endif  // _TIMINGWHEELHEAD_
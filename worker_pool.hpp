@@ -0,0 +1,87 @@
+#ifndef _WORKERPOOLHEAD_
+#define _WORKERPOOLHEAD_
+
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+class Worker_pool {
+    // Threads for blocking disk and CPU work, kept apart from the io_context threads so a slow
+    // job only holds up the request that asked for it
+    // At most max_queue jobs may be waiting, anything beyond that is turned away at once so
+    // overload shows up as fast 503s instead of a queue that grows without bound
+
+    public:
+        Worker_pool(unsigned int threads, std::size_t max_queue) :
+            pool(threads), max_queue(max_queue), queued(0)
+        {}
+
+        // Runs work() on a pool thread and calls done(ec, result) on done's associated executor,
+        // usually the strand of the connection that asked
+        // ec is asio::error::would_block when the queue is full and work was not run
+        template <typename Work, typename Done>
+        void submit(Work work, Done done)
+        {
+            auto executor = boost::asio::get_associated_executor(done);
+            typedef decltype(work()) Result;
+
+            if (queued.fetch_add(1, std::memory_order_relaxed) >= max_queue)
+            {
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                boost::asio::post(executor, [done = std::move(done)]() mutable
+                {
+                    done(boost::system::error_code(boost::asio::error::would_block), Result());
+                });
+                return;
+            }
+
+            boost::asio::post(pool, [this, work, done = std::move(done), executor]() mutable
+            {
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                Result result = work();
+                boost::asio::post(executor, [done = std::move(done), result]() mutable
+                {
+                    done(boost::system::error_code(), std::move(result));
+                });
+            });
+        }
+
+        // Runs work() on a pool thread when nobody waits for the result, false if the queue is full
+        template <typename Work>
+        bool post(Work work)
+        {
+            if (queued.fetch_add(1, std::memory_order_relaxed) >= max_queue)
+            {
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            boost::asio::post(pool, [this, work]() mutable
+            {
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                work();
+            });
+            return true;
+        }
+
+        // Jobs waiting for a thread
+        std::size_t queue_depth() const
+        {
+            return queued.load(std::memory_order_relaxed);
+        }
+
+        // Finishes the queued jobs and joins the threads
+        void stop()
+        {
+            pool.join();
+        }
+
+    private:
+        boost::asio::thread_pool pool;
+        std::size_t max_queue;
+        std::atomic<std::size_t> queued;
+};
+
+#endif  // _WORKERPOOLHEAD_